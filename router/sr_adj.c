@@ -0,0 +1,62 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_adj.h"
+#include "sr_if.h"
+#include "sr_rcu.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+
+/* ---< public functions >--------------------------------------------------- */
+/* --< bind >---------------------------------------------------------------- */
+void
+sr_adj_bind (struct sr_instance * sr, struct sr_rt * route)
+{
+  struct sr_if * iface = sr_get_interface(sr,route->interface);
+  struct sr_adj * adj;
+  void * mem;
+
+  if(route->adj || iface == NULL) return;
+
+  /* as many adjacencies as interface and gateway pairs, so a walk is fine */
+  for(adj = sr->adj_list; adj; adj = adj->next) {
+    if(adj->iface == iface && adj->nexthop == route->gw.s_addr)
+      break;
+  }
+
+  if(adj == NULL) {
+    if(posix_memalign(&mem,sizeof(struct sr_adj),sizeof(struct sr_adj)) != 0)
+      mem = NULL;
+    assert(mem);
+    adj = mem;
+    adj->nexthop = route->gw.s_addr;
+    adj->slot = -1;
+    memcpy(adj->src,iface->addr,ETHER_ADDR_LEN);
+    adj->ifindex = iface->index;
+    adj->iface = iface;
+    adj->refs = 0;
+    adj->next = sr->adj_list;
+    sr->adj_list = adj;
+  }
+
+  adj->refs++;
+  sr_rcu_assign_pointer(route->adj,adj);
+}
+/* --< unbind >-------------------------------------------------------------- */
+void
+sr_adj_unbind (struct sr_instance * sr, struct sr_rt * route)
+{
+  struct sr_adj * adj = route->adj;
+  struct sr_adj ** walker;
+
+  if(adj == NULL || --adj->refs > 0) return;
+
+  for(walker = &(sr->adj_list); *walker; walker = &((*walker)->next)) {
+    if(*walker == adj) {
+      *walker = adj->next;
+      break;
+    }
+  }
+  sr_rcu_defer_free(&(sr->rcu),adj);
+}
@@ -0,0 +1,63 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_adj.h
+ *
+ * Description:
+ *
+ * Adjacency table. Each route is bound, when it is loaded, to the
+ * adjacency for its egress interface and gateway: the interface index, the
+ * source MAC to put on the frame and a handle to the neighbor entry for the
+ * gateway. Forwarding a packet then fills in the Ethernet header from one
+ * adjacency instead of looking the interface up by name and searching the
+ * ARP cache.
+ *
+ * Routes sharing an interface and gateway share an adjacency. The table is
+ * changed under sr->rt_lock; adjacencies a route update drops are freed
+ * through sr->rcu like the routes themselves.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ADJ_H
+#define SR_ADJ_H
+
+#include <stdint.h>
+
+#include "sr_protocol.h"
+
+struct sr_instance;
+struct sr_if;
+struct sr_rt;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_adj
+ *
+ * Everything the forwarding path reads comes first and fits in one cache
+ * line.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_adj {
+  uint32_t nexthop;                     /* gateway, 0 for on link routes */
+  int slot;                             /* neighbor entry hint, -1 if none */
+  unsigned char src[ETHER_ADDR_LEN];    /* MAC of the egress interface */
+  uint16_t ifindex;                     /* egress interface index */
+  struct sr_if * iface;                 /* egress interface */
+
+  /* writers only */
+  unsigned int refs;                    /* routes bound to this adjacency */
+  struct sr_adj * next;
+} __attribute__((aligned(64)));
+
+/* Binds route to the adjacency for its interface and gateway, creating it
+   if need be. Leaves route->adj NULL if the interface does not exist yet.
+   Call with sr->rt_lock held, before route is published or, for a route
+   already in the fib, at any time. */
+void sr_adj_bind(struct sr_instance * sr, struct sr_rt * route);
+
+/* Drops route's reference on its adjacency, handing it to sr->rcu once no
+   route uses it. Call with sr->rt_lock held, after route is unlinked. */
+void sr_adj_unbind(struct sr_instance * sr, struct sr_rt * route);
+
+/* Next hop for a packet to ip sent through adj, in network byte order. */
+#define sr_adj_nexthop(adj,ip) ((adj)->nexthop ? (adj)->nexthop : (ip))
+
+#endif /* -- SR_ADJ_H -- */
@@ -1,4 +1,5 @@
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -12,50 +13,330 @@
 #include "sr_protocol.h"
 
 /* 
-  This function gets called every second. For each request sent out, we keep
-  checking whether we should resend an request or destroy the arp request.
-  See the comments in the header file for an idea of what it should look like.
+  Called by the timer wheel when a request is due to be sent again. The
+  request may be destroyed along the way.
 */
-void sr_arpcache_sweepreqs(struct sr_instance *sr) { 
-  struct sr_arpreq * req = sr->cache.requests;
+static void sr_arpreq_timeout(struct sr_timer *timer, void *sr) {
+  sr_handle_arpreq((struct sr_instance *)sr, (struct sr_arpreq *)timer);
+}
 
-  while(req) {
-    sr_handle_arpreq(sr,req);
-    req = req->next;
-  }
+void sr_arpreq_retry(struct sr_instance *sr, struct sr_arpreq *req,
+                     unsigned long ms) {
+  req->timer.fn = sr_arpreq_timeout;
+  req->timer.arg = sr;
+  sr_timer_add(&(sr->cache.wheel), &(req->timer), ms);
 }
 
 /* You should not need to touch the rest of this code. */
 
-/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
-   You must free the returned structure if it is not NULL. */
-struct sr_arpentry * sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
-    pthread_mutex_lock(&(cache->lock));
-    
-    struct sr_arpentry *entry = NULL, *copy = NULL;
-    
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
+/* Home slot of ip: Fibonacci hashing spreads the low bits that tell hosts
+   on one subnet apart over the whole table. */
+static unsigned int sr_arpcache_hash(struct sr_arpcache *cache, uint32_t ip) {
+    return (uint32_t)(ip * 2654435761u) >> cache->shift;
+}
+
+/* Writers hold cache->lock and bracket every change to the entries with
+   these, so lookups can copy an entry out without taking the lock: seq is
+   odd while a change is under way and moves on once it is done. */
+static void sr_arpcache_write_begin(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void sr_arpcache_write_end(struct sr_arpcache *cache) {
+    __atomic_store_n(&(cache->seq), cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Slot holding ip, or the empty slot that ends its probe sequence. */
+static unsigned int sr_arpcache_find(struct sr_arpcache *cache, uint32_t ip) {
+    unsigned int mask = cache->size - 1;
+    unsigned int i = sr_arpcache_hash(cache, ip);
+
+    while (cache->keys[i] && cache->keys[i] != ip)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+/* Empties slot i, shifting later entries of its cluster back so no probe
+   sequence is broken by the hole. */
+static void sr_arpcache_remove(struct sr_arpcache *cache, unsigned int i) {
+    unsigned int mask = cache->size - 1;
+    unsigned int j = i, home;
+
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!cache->entries[j].valid)
+            break;
+        home = sr_arpcache_hash(cache, cache->entries[j].ip);
+        /* -- the entry may move back unless its home lies in (i, j] -- */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cache->entries[i] = cache->entries[j];
+            __atomic_store_n(&(cache->keys[i]), cache->keys[j], __ATOMIC_RELAXED);
+            i = j;
         }
     }
-    
-    /* Must return a copy b/c another thread could jump in and modify
-       table after we return. */
-    if (entry) {
-        copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
-        memcpy(copy, entry, sizeof(struct sr_arpentry));
+
+    cache->entries[i].valid = 0;
+    __atomic_store_n(&(cache->keys[i]), 0, __ATOMIC_RELAXED);
+    cache->count--;
+}
+
+/* Removes the entry in slot i along with its expiry. */
+static void sr_arpcache_drop(struct sr_arpcache *cache, unsigned int i) {
+    struct sr_arptimer *t = &(cache->timers[cache->entries[i].timer]);
+
+    sr_timer_del(&(t->timer));
+    t->next_free = cache->tfree;
+    cache->tfree = t;
+
+    sr_arpcache_remove(cache, i);
+}
+
+/* Runs when the entry for the timer's ip comes within SR_ARPCACHE_PROBES
+   probe intervals of expiring, then once every interval. An entry in use
+   is asked to confirm it is current, which a reply does by way of
+   sr_arpcache_insert, and stays valid meanwhile. An idle one goes stale,
+   but is probed as soon as it's used again. */
+static void sr_arpcache_age(struct sr_timer *timer, void *arg) {
+    struct sr_arpcache *cache = arg;
+    unsigned int i = sr_arpcache_find(cache, ((struct sr_arptimer *)timer)->ip);
+    struct sr_arpentry *entry = &(cache->entries[i]);
+
+    if (entry->probes == SR_ARPCACHE_PROBES) {
+        sr_arpcache_write_begin(cache);
+        sr_arpcache_drop(cache, i);
+        sr_arpcache_write_end(cache);
+        return;
     }
-        
-    pthread_mutex_unlock(&(cache->lock));
-    
-    return copy;
+
+    if (cache->now - __atomic_load_n(&(entry->used), __ATOMIC_RELAXED) < SR_ARPCACHE_ACTIVE) {
+        entry->state = sr_arp_probe;
+        sr_send_arp_probe(cache->sr, entry->ip, entry->mac, entry->iface);
+    } else if (entry->state == sr_arp_reachable) {
+        entry->state = sr_arp_stale;
+    }
+    entry->probes++;
+    sr_timer_add(&(cache->wheel), timer, SR_ARPCACHE_PROBE_MS);
+}
+
+/* Removes the least recently used of SR_ARPCACHE_SAMPLE entries taken from a
+   random point in the table. Pinned entries are passed over, so returns 0
+   if they are all there is. */
+static int sr_arpcache_evict(struct sr_arpcache *cache) {
+    unsigned int mask = cache->size - 1;
+    unsigned int i = (unsigned int)rand() & mask;
+    unsigned int victim = i, seen = 0, n;
+
+    for (n = 0; n < cache->size && seen < SR_ARPCACHE_SAMPLE; n++, i = (i + 1) & mask) {
+        if (!cache->entries[i].valid || cache->entries[i].state == sr_arp_permanent)
+            continue;
+        if (!seen++ || cache->entries[i].used < cache->entries[victim].used)
+            victim = i;
+    }
+    if (!seen)
+        return 0;
+
+    sr_arpcache_drop(cache, victim);
+    cache->evicted++;
+    return 1;
+}
+
+/* Lock-free search behind both lookups. Tries the slot in *hint first,
+   copies the MAC for ip into mac unless it's NULL and leaves the slot ip
+   was found in in *hint. The table never moves, so a search racing a
+   writer reads stale entries at worst, and is then simply run again. */
+static int sr_arpcache_read(struct sr_arpcache *cache, uint32_t ip,
+                            unsigned int *hint, unsigned char *mac) {
+    struct sr_arpentry *entries = cache->entries;
+    uint32_t *keys = cache->keys;
+    unsigned int mask = cache->size - 1;
+    unsigned char copy[ETHER_ADDR_LEN];
+    unsigned int seq, i, n;
+    uint32_t key;
+    int found;
+
+    do {
+        /* -- the writer may have been preempted mid change -- */
+        while ((seq = __atomic_load_n(&(cache->seq), __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+        i = *hint;
+        found = i < cache->size && ip
+            && __atomic_load_n(&(keys[i]), __ATOMIC_RELAXED) == ip;
+        if (!found) {
+            i = sr_arpcache_hash(cache, ip);
+            /* -- bounded, as a torn read may never meet an empty slot -- */
+            for (n = 0; n < cache->size
+                    && (key = __atomic_load_n(&(keys[i]), __ATOMIC_RELAXED)); n++) {
+                if (key == ip) {
+                    found = 1;
+                    break;
+                }
+                i = (i + 1) & mask;
+            }
+        }
+        if (found)
+            memcpy(copy, entries[i].mac, ETHER_ADDR_LEN);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&(cache->seq), __ATOMIC_RELAXED) != seq);
+
+    if (!found)
+        return 0;
+
+    if (mac)
+        memcpy(mac, copy, ETHER_ADDR_LEN);
+    *hint = i;
+
+    /* Stamped at most once a second, so hits don't keep dirtying the line.
+       Should the entry have moved since, some neighbor looks fresher. */
+    time_t now = __atomic_load_n(&(cache->now), __ATOMIC_RELAXED);
+    if (__atomic_load_n(&(entries[i].used), __ATOMIC_RELAXED) != now)
+        __atomic_store_n(&(entries[i].used), now, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
+   Copies the MAC into mac, unless it is NULL, and returns 1 on a hit. */
+int sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip,
+                       unsigned char *mac) {
+    unsigned int hint = cache->size;
+
+    return sr_arpcache_read(cache, ip, &hint, mac);
+}
+
+/* Like sr_arpcache_lookup, but tries the entry at *slot before searching
+   the table. */
+int sr_arpcache_lookup_slot(struct sr_arpcache *cache, uint32_t ip,
+                            int *slot, unsigned char *mac) {
+    int i = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    unsigned int hint = i < 0 ? cache->size : (unsigned int)i;
+
+    if (!sr_arpcache_read(cache, ip, &hint, mac))
+        return 0;
+
+    /* -- several threads may race here, any winner is a good hint -- */
+    if ((int)hint != i)
+        __atomic_store_n(slot, (int)hint, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+/* Takes pkt off the list of queued packets by age. */
+static void sr_arpcache_age_unlink(struct sr_arpcache *cache,
+                                   struct sr_packet *pkt) {
+    if (pkt->older)
+        pkt->older->newer = pkt->newer;
+    else
+        cache->oldest = pkt->newer;
+    if (pkt->newer)
+        pkt->newer->older = pkt->older;
+    else
+        cache->newest = pkt->older;
+}
+
+/* Returns pkt's buffer to the pool. */
+static void sr_arpcache_pkt_put(struct sr_arpcache *cache,
+                                struct sr_packet *pkt) {
+    cache->qbytes -= pkt->len;
+    pkt->next = cache->pool;
+    cache->pool = pkt;
+}
+
+/* Drops pkt, which is the oldest packet of its request. */
+static void sr_arpcache_pkt_drop(struct sr_arpcache *cache,
+                                 struct sr_packet *pkt) {
+    struct sr_arpreq *req = pkt->req;
+
+    req->packets = pkt->next;
+    if (!req->packets)
+        req->tail = NULL;
+    req->npackets--;
+
+    sr_arpcache_age_unlink(cache, pkt);
+    sr_arpcache_pkt_put(cache, pkt);
+    cache->qdrops++;
+}
+
+/* Takes a buffer from the pool for a packet of len bytes to queue on req,
+   first dropping queued packets as the policy allows until neither req nor
+   the pool is over its limits. Returns NULL if the packet itself is to be
+   dropped. Every request's packets are queued in order, so the oldest of
+   all of them is also the oldest of its own request. */
+static struct sr_packet *sr_arpcache_pkt_get(struct sr_arpcache *cache,
+                                             struct sr_arpreq *req,
+                                             unsigned int len) {
+    struct sr_packet *pkt;
+
+    if (len > SR_ARPCACHE_PKTSZ)
+        return NULL;
+
+    while (req->npackets >= SR_ARPREQ_QLEN || !cache->pool
+            || cache->qbytes + len > SR_ARPCACHE_QBYTES) {
+        if (cache->policy == sr_arpq_drop_newest)
+            return NULL;
+        pkt = req->npackets >= SR_ARPREQ_QLEN ? req->packets : cache->oldest;
+        /* -- whatever is left belongs to requests already unqueued -- */
+        if (!pkt)
+            return NULL;
+        sr_arpcache_pkt_drop(cache, pkt);
+    }
+
+    pkt = cache->pool;
+    cache->pool = pkt->next;
+    return pkt;
+}
+
+/* Queued request for ip, or NULL. */
+static struct sr_arpreq *sr_arpreq_find(struct sr_arpcache *cache,
+                                        uint32_t ip) {
+    struct sr_arpreq *req = cache->reqhash[sr_arpcache_hash(cache, ip)];
+
+    while (req && req->ip != ip)
+        req = req->hnext;
+
+    return req;
+}
+
+/* Puts req on the request queue and in its hash bucket. */
+static void sr_arpreq_link(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    struct sr_arpreq **bucket = &(cache->reqhash[sr_arpcache_hash(cache, req->ip)]);
+
+    req->prev = NULL;
+    req->next = cache->requests;
+    if (req->next)
+        req->next->prev = req;
+    cache->requests = req;
+
+    req->hnext = *bucket;
+    *bucket = req;
+    req->queued = 1;
+}
+
+/* Takes req off the request queue and out of its bucket, if it's there. */
+static void sr_arpreq_unlink(struct sr_arpcache *cache, struct sr_arpreq *req) {
+    struct sr_arpreq **pp = &(cache->reqhash[sr_arpcache_hash(cache, req->ip)]);
+
+    if (!req->queued)
+        return;
+
+    if (req->prev)
+        req->prev->next = req->next;
+    else
+        cache->requests = req->next;
+    if (req->next)
+        req->next->prev = req->prev;
+
+    while (*pp != req)
+        pp = &((*pp)->hnext);
+    *pp = req->hnext;
+    req->queued = 0;
 }
 
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. You should free the passed *packet.
+   that corresponds to this ARP request. The packet is copied, so the caller
+   should still free the passed *packet.
    
    A pointer to the ARP request is returned; it should not be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
@@ -67,32 +348,48 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
 {
     pthread_mutex_lock(&(cache->lock));
     
-    struct sr_arpreq *req;
-    for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {
-            break;
-        }
-    }
+    struct sr_arpreq *req = sr_arpreq_find(cache, ip);
     
     /* If the IP wasn't found, add it */
     if (!req) {
         req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
         req->ip = ip;
-        req->next = cache->requests;
-        cache->requests = req;
+        if (iface)
+            strncpy(req->iface, iface, sr_IFACE_NAMELEN - 1);
+        sr_arpreq_link(cache, req);
     }
     
     /* Add the packet to the list of packets for this request */
     if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
+        struct sr_packet *new_pkt = sr_arpcache_pkt_get(cache, req, packet_len);
         
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-		    new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+        if (new_pkt) {
+            new_pkt->buf = new_pkt->data;
+            memcpy(new_pkt->buf, packet, packet_len);
+            new_pkt->len = packet_len;
+            strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN - 1);
+            new_pkt->iface[sr_IFACE_NAMELEN - 1] = '\0';
+            cache->qbytes += packet_len;
+            
+            new_pkt->req = req;
+            new_pkt->next = NULL;
+            if (req->tail)
+                req->tail->next = new_pkt;
+            else
+                req->packets = new_pkt;
+            req->tail = new_pkt;
+            req->npackets++;
+            
+            new_pkt->newer = NULL;
+            new_pkt->older = cache->newest;
+            if (cache->newest)
+                cache->newest->newer = new_pkt;
+            else
+                cache->oldest = new_pkt;
+            cache->newest = new_pkt;
+        } else {
+            cache->qdrops++;
+        }
     }
     
     pthread_mutex_unlock(&(cache->lock));
@@ -100,83 +397,174 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
     return req;
 }
 
+/* Removes req from the request queue without freeing it, and its packets
+   from the ones drop oldest may pick. */
+void sr_arpreq_unqueue(struct sr_arpcache *cache, struct sr_arpreq *entry) {
+    pthread_mutex_lock(&(cache->lock));
+    
+    sr_timer_del(&(entry->timer));
+    if (entry->queued) {
+        sr_arpreq_unlink(cache, entry);
+        
+        struct sr_packet *pkt;
+        for (pkt = entry->packets; pkt; pkt = pkt->next) {
+            sr_arpcache_age_unlink(cache, pkt);
+            pkt->req = NULL;
+        }
+    }
+    
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/* Maps ip to mac, on the interface with index iface, adding an entry or
+   confirming the one there. A pinned entry only changes when pinned again.
+   Caller holds the lock. Returns 0 if the table is full of pinned entries. */
+static int sr_arpcache_set(struct sr_arpcache *cache, unsigned char *mac,
+                           uint32_t ip, unsigned int iface, int permanent) {
+    unsigned int i = sr_arpcache_find(cache, ip);
+    struct sr_arptimer *t;
+
+    /* -- 0 marks an empty slot in keys -- */
+    if (!ip)
+        return 1;
+    if (cache->entries[i].valid && cache->entries[i].state == sr_arp_permanent
+            && !permanent)
+        return 1;
+
+    sr_arpcache_write_begin(cache);
+    
+    /* A full cache makes room, which may shift the slot ip belongs in */
+    if (!cache->entries[i].valid && cache->count == cache->max) {
+        if (!sr_arpcache_evict(cache)) {
+            sr_arpcache_write_end(cache);
+            return 0;
+        }
+        i = sr_arpcache_find(cache, ip);
+    }
+    
+    if (!cache->entries[i].valid) {
+        t = cache->tfree;
+        cache->tfree = t->next_free;
+        t->ip = ip;
+        cache->entries[i].timer = t - cache->timers;
+        cache->count++;
+    }
+    t = &(cache->timers[cache->entries[i].timer]);
+    if (permanent)
+        sr_timer_del(&(t->timer));
+    else
+        sr_timer_add(&(cache->wheel), &(t->timer),
+                     (unsigned long)(SR_ARPCACHE_TO * 1000)
+                     - SR_ARPCACHE_PROBES * SR_ARPCACHE_PROBE_MS);
+    memcpy(cache->entries[i].mac, mac, 6);
+    cache->entries[i].state = permanent ? sr_arp_permanent : sr_arp_reachable;
+    cache->entries[i].probes = 0;
+    cache->entries[i].iface = iface;
+    cache->entries[i].ip = ip;
+    cache->entries[i].added = time(NULL);
+    cache->entries[i].used = cache->now;
+    cache->entries[i].valid = 1;
+    __atomic_store_n(&(cache->keys[i]), ip, __ATOMIC_RELAXED);
+    
+    sr_arpcache_write_end(cache);
+    
+    return 1;
+}
+
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
    2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip)
+                                     uint32_t ip,
+                                     unsigned int iface)
 {
     pthread_mutex_lock(&(cache->lock));
     
-    struct sr_arpreq *req, *prev = NULL, *next = NULL; 
-    for (req = cache->requests; req != NULL; req = req->next) {
-        if (req->ip == ip) {            
-            if (prev) {
-                next = req->next;
-                prev->next = next;
-            } 
-            else {
-                next = req->next;
-                cache->requests = next;
-            }
-            
-            break;
-        }
-        prev = req;
-    }
-    
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
-            break;
-    }
+    struct sr_arpreq *req = sr_arpreq_find(cache, ip);
+    if (req)
+        sr_arpreq_unqueue(cache, req);
     
-    if (i != SR_ARPCACHE_SZ) {
-        memcpy(cache->entries[i].mac, mac, 6);
-        cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
-        cache->entries[i].valid = 1;
-    }
+    sr_arpcache_set(cache, mac, ip, iface, 0);
     
     pthread_mutex_unlock(&(cache->lock));
     
     return req;
 }
 
+/* Reads "<ip> <mac> <iface>" lines, skipping blank ones and # comments,
+   and pins each neighbor. */
+int sr_arpcache_load(struct sr_instance *sr, const char *path) {
+    struct sr_arpcache *cache = &(sr->cache);
+    char line[BUFSIZ], ip_s[32], mac_s[32], if_s[sr_IFACE_NAMELEN];
+    unsigned int m[ETHER_ADDR_LEN];
+    unsigned char mac[ETHER_ADDR_LEN];
+    struct in_addr ip;
+    struct sr_if *iface;
+    int lineno = 0, ret = 0, i;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+
+    while (ret == 0 && fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if (sscanf(line, " %31s", ip_s) != 1 || ip_s[0] == '#')
+            continue;
+        if (sscanf(line, "%31s %31s %31s", ip_s, mac_s, if_s) != 3
+                || inet_aton(ip_s, &ip) == 0 || ip.s_addr == 0
+                || sscanf(mac_s, "%x:%x:%x:%x:%x:%x",
+                          &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) {
+            fprintf(stderr, "%s:%d: expected <ip> <mac> <iface>\n", path, lineno);
+            ret = -1;
+            break;
+        }
+        for (i = 0; i < ETHER_ADDR_LEN; i++) {
+            if (m[i] > 0xff)
+                ret = -1;
+            mac[i] = m[i];
+        }
+        if (ret) {
+            fprintf(stderr, "%s:%d: bad MAC address %s\n", path, lineno, mac_s);
+            break;
+        }
+        if (!(iface = sr_get_interface(sr, if_s))) {
+            fprintf(stderr, "%s:%d: no interface %s\n", path, lineno, if_s);
+            ret = -1;
+            break;
+        }
+        
+        pthread_mutex_lock(&(cache->lock));
+        if (!sr_arpcache_set(cache, mac, ip.s_addr, iface->index, 1)) {
+            fprintf(stderr, "%s:%d: more neighbors than the cache holds\n", path, lineno);
+            ret = -1;
+        }
+        pthread_mutex_unlock(&(cache->lock));
+    }
+
+    fclose(fp);
+    return ret;
+}
+
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
     pthread_mutex_lock(&(cache->lock));
     
     if (entry) {
-        struct sr_arpreq *req, *prev = NULL, *next = NULL; 
-        for (req = cache->requests; req != NULL; req = req->next) {
-            if (req == entry) {                
-                if (prev) {
-                    next = req->next;
-                    prev->next = next;
-                } 
-                else {
-                    next = req->next;
-                    cache->requests = next;
-                }
-                
-                break;
-            }
-            prev = req;
-        }
+        sr_timer_del(&(entry->timer));
+        sr_arpreq_unlink(cache, entry);
         
         struct sr_packet *pkt, *nxt;
         
         for (pkt = entry->packets; pkt; pkt = nxt) {
             nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
+            if (pkt->req)
+                sr_arpcache_age_unlink(cache, pkt);
+            sr_arpcache_pkt_put(cache, pkt);
         }
         
         free(entry);
@@ -187,28 +575,109 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
 
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache) {
-    fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
+    static const char *states[] = { "reachable", "stale", "probe", "permanent" };
+    
+    pthread_mutex_lock(&(cache->lock));
+    
+    fprintf(stderr, "\n%u of %u entries, %lu evicted\n", cache->count, cache->max, cache->evicted);
+    fprintf(stderr, "%u bytes queued, %lu packets dropped\n", cache->qbytes, cache->qdrops);
+    fprintf(stderr, "MAC            IP         ADDED                      STATE\n");
     fprintf(stderr, "-----------------------------------------------------------\n");
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+    unsigned int i;
+    for (i = 0; i < cache->size; i++) {
         struct sr_arpentry *cur = &(cache->entries[i]);
+        if (!cur->valid)
+            continue;
         unsigned char *mac = cur->mac;
-        fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), cur->valid);
+        fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %s\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), states[cur->state]);
     }
     
     fprintf(stderr, "\n");
+    
+    pthread_mutex_unlock(&(cache->lock));
 }
 
 /* Initialize table + table lock. Returns 0 on success. */
-int sr_arpcache_init(struct sr_arpcache *cache) {  
+int sr_arpcache_init(struct sr_arpcache *cache, unsigned int size,
+                     enum sr_arpq_policy policy) {  
     /* Seed RNG to kick out a random entry if all entries full. */
     srand(time(NULL));
     
+    if (size == 0 || size > SR_ARPCACHE_MAX)
+        return -1;
+    
+    /* At least two slots per entry, so at most half the table is in use */
+    cache->size = 16;
+    cache->shift = 28;
+    while (cache->size < 2 * size) {
+        cache->size <<= 1;
+        cache->shift--;
+    }
+    cache->max = size;
+    cache->count = 0;
+    cache->evicted = 0;
+    cache->now = time(NULL);
+    cache->sr = NULL;
+    cache->seq = 0;
+    
     /* Invalidate all entries */
-    memset(cache->entries, 0, sizeof(cache->entries));
+    cache->entries = calloc(cache->size, sizeof(struct sr_arpentry));
+    if (!cache->entries)
+        return -1;
     cache->requests = NULL;
     
+    /* and their keys, all empty */
+    cache->keys = calloc(cache->size, sizeof(uint32_t));
+    if (!cache->keys) {
+        free(cache->entries);
+        return -1;
+    }
+    
+    /* Requests are hashed like entries, one bucket per slot */
+    cache->reqhash = calloc(cache->size, sizeof(struct sr_arpreq *));
+    if (!cache->reqhash) {
+        free(cache->keys);
+        free(cache->entries);
+        return -1;
+    }
+    
+    /* Expiry timers, one for each entry the cache holds */
+    cache->timers = calloc(size, sizeof(struct sr_arptimer));
+    if (!cache->timers) {
+        free(cache->reqhash);
+        free(cache->keys);
+        free(cache->entries);
+        return -1;
+    }
+    unsigned int i;
+    cache->tfree = NULL;
+    for (i = 0; i < size; i++) {
+        sr_timer_init(&(cache->timers[i].timer), sr_arpcache_age, cache);
+        cache->timers[i].next_free = cache->tfree;
+        cache->tfree = &(cache->timers[i]);
+    }
+    sr_timer_wheel_init(&(cache->wheel));
+    
+    /* Buffers for packets waiting on requests */
+    cache->slab = calloc(SR_ARPCACHE_QPKTS, sizeof(struct sr_packet));
+    if (!cache->slab) {
+        free(cache->timers);
+        free(cache->reqhash);
+        free(cache->keys);
+        free(cache->entries);
+        return -1;
+    }
+    cache->pool = NULL;
+    for (i = 0; i < SR_ARPCACHE_QPKTS; i++) {
+        cache->slab[i].next = cache->pool;
+        cache->pool = &(cache->slab[i]);
+    }
+    cache->oldest = cache->newest = NULL;
+    cache->qbytes = 0;
+    cache->policy = policy;
+    cache->qdrops = 0;
+    
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
     pthread_mutexattr_settype(&(cache->attr), PTHREAD_MUTEX_RECURSIVE);
@@ -219,34 +688,40 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    free(cache->entries);
+    cache->entries = NULL;
+    free(cache->keys);
+    cache->keys = NULL;
+    free(cache->slab);
+    cache->slab = NULL;
+    free(cache->reqhash);
+    cache->reqhash = NULL;
+    free(cache->timers);
+    cache->timers = NULL;
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
+/* Thread which drives the cache's timer wheel, expiring entries that were
+   added more than SR_ARPCACHE_TO seconds ago and retrying requests. */
 void *sr_arpcache_timeout(void *sr_ptr) {
     struct sr_instance *sr = sr_ptr;
     struct sr_arpcache *cache = &(sr->cache);
+    struct timespec tick = { 0, SR_TIMER_TICK_MS * 1000000L };
+    
+    /* Timers only fire on this thread, so probes have a router from now */
+    cache->sr = sr;
     
     while (1) {
-        sleep(1.0);
+        nanosleep(&tick, NULL);
         
         pthread_mutex_lock(&(cache->lock));
-    
-        time_t curtime = time(NULL);
         
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
-        }
+        __atomic_store_n(&(cache->now), time(NULL), __ATOMIC_RELAXED);
+        /* Catches up on any ticks missed while the thread was held up */
+        sr_timer_run(&(cache->wheel), sr_timer_clock());
         
-        sr_arpcache_sweepreqs(sr);
-
         pthread_mutex_unlock(&(cache->lock));
     }
     
     return NULL;
 }
-
@@ -2,21 +2,19 @@
    request queue, and ARP cache entries. The ARP request queue holds data about
    an outgoing ARP cache request and the packets that are waiting on a reply
    to that ARP cache request. The ARP cache entries hold IP->MAC mappings and
-   are timed out every SR_ARPCACHE_TO seconds.
+   are timed out SR_ARPCACHE_TO seconds after they are added.
 
    Pseudocode for use of these structures follows.
 
    --
 
    # When sending packet to next_hop_ip
-   entry = arpcache_lookup(next_hop_ip)
-
-   if entry:
-       use next_hop_ip->mac mapping in entry to send the packet
-       free entry
+   if arpcache_lookup(next_hop_ip, mac):
+       use next_hop_ip->mac mapping in mac to send the packet
    else:
        req = arpcache_queuereq(next_hop_ip, packet, len)
-       handle_arpreq(req)
+       if req->times_sent == 0:
+           handle_arpreq(req)
 
    --
 
@@ -24,15 +22,15 @@
    handle sending ARP requests if necessary:
 
    function handle_arpreq(req):
-       if difftime(now, req->sent) > 1.0
-           if req->times_sent >= 5:
-               send icmp host unreachable to source addr of all pkts waiting
-                 on this request
-               arpreq_destroy(req)
-           else:
-               send arp request
-               req->sent = now
-               req->times_sent++
+       if req->times_sent >= 5:
+           send icmp host unreachable to source addr of all pkts waiting
+             on this request
+           arpreq_destroy(req)
+       else:
+           send arp request
+           req->sent = now
+           req->times_sent++
+           arpreq_retry(req, SR_ARPREQ_RETRY_MS)
 
    --
 
@@ -50,17 +48,13 @@
 
    To meet the guidelines in the assignment (ARP requests are sent every second
    until we send 5 ARP requests, then we send ICMP host unreachable back to
-   all packets waiting on this ARP request), you must fill out the following
-   function that is called every second and is defined in sr_arpcache.c:
-
-   void sr_arpcache_sweepreqs(struct sr_instance *sr) {
-       for each request on sr->cache.requests:
-           handle_arpreq(request)
-   }
+   all packets waiting on this ARP request), arpreq_retry arms a timer on the
+   request that calls handle_arpreq again from the timeout thread.
 
-   Since handle_arpreq as defined in the comments above could destroy your
-   current request, make sure to save the next pointer before calling
-   handle_arpreq when traversing through the ARP requests linked list.
+   Entry expiry and request retries both run off a timer wheel (sr_timer.h)
+   that the timeout thread advances every SR_TIMER_TICK_MS under the cache
+   lock, so a tick costs only the timers that fire in it. handle_arpreq and
+   everything it calls run with the lock held.
  */
 
 #ifndef SR_ARPCACHE_H
@@ -70,50 +64,147 @@
 #include <time.h>
 #include <pthread.h>
 #include "sr_if.h"
+#include "sr_timer.h"
+
+struct sr_instance;
+
+#define SR_ARPCACHE_SZ     1024   /* neighbors held by default */
+#define SR_ARPCACHE_MAX    65536  /* most neighbors -a may ask for */
+#define SR_ARPCACHE_SAMPLE 8      /* entries compared when evicting */
+#define SR_ARPCACHE_TO     15.0
+#define SR_ARPREQ_RETRY_MS 1000   /* between ARP requests for one address */
+
+/* An entry still in use when it nears SR_ARPCACHE_TO is refreshed with
+   unicast requests, sent this many times at this interval, ending at
+   expiry. "In use" means looked up in the last SR_ARPCACHE_ACTIVE s. */
+#define SR_ARPCACHE_PROBES   3
+#define SR_ARPCACHE_PROBE_MS 1000
+#define SR_ARPCACHE_ACTIVE   3
 
-#define SR_ARPCACHE_SZ    100  
-#define SR_ARPCACHE_TO    15.0
+/* Neighbor states, after Linux's. Lookups use entries in any of them. */
+enum sr_arpstate {
+    sr_arp_reachable,           /* confirmed, not yet near expiry */
+    sr_arp_stale,               /* near expiry and idle, left to expire */
+    sr_arp_probe,               /* near expiry and in use, being refreshed */
+    sr_arp_permanent            /* pinned from the neighbor file */
+};
+
+#define SR_ARPREQ_QLEN     16            /* packets held per request */
+#define SR_ARPCACHE_QPKTS  256           /* packets held over all requests */
+#define SR_ARPCACHE_QBYTES (256 * 1024)  /* bytes held over all requests */
+#define SR_ARPCACHE_PKTSZ  1514          /* largest frame that can be held */
+
+/* What a full pending queue gives up to hold one more packet */
+enum sr_arpq_policy {
+    sr_arpq_drop_newest,        /* the packet arriving */
+    sr_arpq_drop_oldest         /* the packet waiting longest */
+};
 
 struct sr_packet {
     uint8_t * buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    char iface[sr_IFACE_NAMELEN]; /* The outgoing interface */
     struct sr_packet *next;
+    struct sr_arpreq *req;      /* Request it waits on, while on its queue */
+    struct sr_packet *older;    /* Neighbors among all queued packets */
+    struct sr_packet *newer;
+    uint8_t data[SR_ARPCACHE_PKTSZ]; /* Storage buf points at */
 };
 
 struct sr_arpentry {
     unsigned char mac[6]; 
+    unsigned char state;        /* enum sr_arpstate */
+    unsigned char probes;       /* Refreshes sent since confirmed */
     uint32_t ip;                /* IP addr in network byte order */
+    unsigned int iface;         /* Index of the interface it is on */
     time_t added;         
+    time_t used;                /* Last lookup that hit, for eviction */
     int valid;
+    unsigned int timer;         /* Its expiry, in the cache's timers */
+};
+
+/* Expiry of an entry. Entries move around the table, so their timers live
+   apart and find them again by ip. */
+struct sr_arptimer {
+    struct sr_timer timer;      /* Must be first */
+    uint32_t ip;
+    struct sr_arptimer *next_free;
 };
 
 struct sr_arpreq {
+    struct sr_timer timer;      /* Next retry, must be first */
     uint32_t ip;
     time_t sent;                /* Last time this ARP request was sent. You 
                                    should update this. If the ARP request was 
                                    never sent, will be 0. */
     uint32_t times_sent;        /* Number of times this request was sent. You 
                                    should update this. */
-    struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
+    struct sr_packet *packets;  /* List of pkts waiting on this req to finish,
+                                   oldest first */
+    struct sr_packet *tail;     /* Newest of packets */
+    unsigned int npackets;
+    char iface[sr_IFACE_NAMELEN]; /* Where the ARP request goes out */
+    int queued;                 /* On the request queue */
     struct sr_arpreq *next;
+    struct sr_arpreq *prev;
+    struct sr_arpreq *hnext;    /* Next in its hash bucket */
 };
 
+/* The entries form an open addressing table keyed by IP with linear
+   probing. It has twice as many slots as neighbors it may hold, so probe
+   sequences stay short, and a full cache evicts its least recently used
+   entry, picked from a random sample, to make room for a new neighbor.
+
+   Lookups probe keys, which mirrors the IP of every slot in an array of
+   its own, 0 for an empty one (0.0.0.0 is never a neighbor). Sixteen slots
+   share a cache line there, so a probe sequence touches one line of keys
+   and only the entry it ends on. */
 struct sr_arpcache {
-    struct sr_arpentry entries[SR_ARPCACHE_SZ];
+    struct sr_arpentry *entries;
+    uint32_t *keys;             /* ip of each valid slot, else 0 */
+    unsigned int size;          /* slots in entries, a power of two */
+    unsigned int shift;         /* 32 - log2(size), for hashing */
+    unsigned int max;           /* entries held before evicting */
+    unsigned int count;         /* valid entries */
+    unsigned long evicted;      /* entries pushed out by newer ones */
+    time_t now;                 /* refreshed by the timeout thread */
+    struct sr_instance *sr;     /* probes go out through, set by the same */
+    struct sr_timer_wheel wheel; /* runs expiry and retries */
+    struct sr_arptimer *timers; /* one per entry held */
+    struct sr_arptimer *tfree;  /* those of no entry */
+    unsigned int seq;           /* odd while entries are being changed */
+    struct sr_packet *slab;     /* every packet buffer, allocated at init */
+    struct sr_packet *pool;     /* the ones not queued */
+    struct sr_packet *oldest;   /* queued packets by age, for drop oldest */
+    struct sr_packet *newest;
+    unsigned int qbytes;        /* bytes held in queued packets */
+    enum sr_arpq_policy policy;
+    unsigned long qdrops;       /* packets that found their queue full */
     struct sr_arpreq *requests;
+    struct sr_arpreq **reqhash; /* requests by ip, size buckets */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
 
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order. 
-   You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
+   Copies the MAC into mac, which may be NULL to only test for ip, and
+   returns 1 on a hit, 0 on a miss. Takes no lock and allocates nothing, so
+   it can be called for every packet sent. */
+int sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip,
+                       unsigned char *mac);
+
+/* Like sr_arpcache_lookup, but slot is a hint owned by the caller, such as
+   an adjacency: the entry checked first, updated whenever ip is found
+   elsewhere. */
+int sr_arpcache_lookup_slot(struct sr_arpcache *cache, uint32_t ip,
+                            int *slot, unsigned char *mac);
 
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. The packet argument should not be
-   freed by the caller.
+   that corresponds to this ARP request. The packet is copied into a buffer
+   from the pool, so the caller still owns it. A packet that would take the
+   request past SR_ARPREQ_QLEN, or all requests past the pool or
+   SR_ARPCACHE_QBYTES, makes room by the cache's policy.
 
    A pointer to the ARP request is returned; it should be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
@@ -126,10 +217,30 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   2) Inserts this IP to MAC mapping, learned on the interface with index
+      iface, in the cache and marks it valid, or confirms it is still
+      current, restarting its timeout. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip);
+                                     uint32_t ip,
+                                     unsigned int iface);
+
+/* Has the timeout thread call sr_handle_arpreq for req in ms. Caller holds
+   the cache lock, as sr_handle_arpreq does. */
+void sr_arpreq_retry(struct sr_instance *sr, struct sr_arpreq *req,
+                     unsigned long ms);
+
+/* Removes req from the request queue without freeing it or retrying it.
+   Its packets can no longer be dropped for newer ones, so they can be
+   walked without the lock.
+   sr_arpcache_insert does this for the request it returns. */
+void sr_arpreq_unqueue(struct sr_arpcache *cache, struct sr_arpreq *req);
+
+/* Pins the neighbors listed in path, a "<ip> <mac> <iface>" line each, as
+   permanent entries: they never expire, are never evicted and ARP traffic
+   does not change them. Call once the interfaces are known. Returns 0 on
+   success, -1 if the file can't be read or has a bad line. */
+int sr_arpcache_load(struct sr_instance *sr, const char *path);
 
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
@@ -141,9 +252,11 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
    a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   seconds. init sizes the table for size neighbors, at most
+   SR_ARPCACHE_MAX, and sets how full pending queues are handled. */
 
-int   sr_arpcache_init(struct sr_arpcache *cache);
+int   sr_arpcache_init(struct sr_arpcache *cache, unsigned int size,
+                       enum sr_arpq_policy policy);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
 
@@ -0,0 +1,354 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_bench.c
+ *
+ * Description:
+ *
+ * Longest prefix match benchmark, built with "make bench". For each table
+ * size it generates a synthetic routing table with a full table's spread
+ * of prefix lengths, compiles it with every lookup engine, and times three
+ * ways of looking up the same destination traces:
+ *
+ *   single  sr_fib_lookup, one destination at a time
+ *   batch   sr_fib_lookup_batch, in bursts
+ *   lpm     sr_longest_prefix_match on a packet, as the forwarding path
+ *           does it
+ *   cached  the same, through the result cache the router's -C turns on
+ *
+ * The uniform trace sends half the lookups inside a random route and half
+ * anywhere. The zipf trace draws from a pool of destinations made the same
+ * way, the k-th most popular with probability proportional to 1/k^s, which
+ * is what the result cache sees from real traffic.
+ *
+ *   sr_bench [-n prefixes] [-l lookups] [-b burst] [-t uniform|zipf]
+ *            [-s zipf exponent]
+ *
+ * Without -n it runs 1k, 100k and 1M prefix tables; without -t, both
+ * traces.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "sr_fib.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_utils.h"
+
+#define BENCH_LOOKUPS  (1 << 22)
+#define BENCH_BURST    64
+#define BENCH_ZIPF_S   1.0
+
+static const unsigned int bench_sizes[] = { 1000, 100000, 1000000 };
+static const char * bench_engines[] = { "trie", "dir24" };
+static const char * bench_traces[] = { "uniform", "zipf" };
+
+/* ---< helpers >------------------------------------------------------------ */
+static uint64_t bench_rng = 88172645463325252ULL;
+
+/* --< xorshift64 >---------------------------------------------------------- */
+static uint32_t
+bench_rand (void)
+{
+  bench_rng ^= bench_rng << 13;
+  bench_rng ^= bench_rng >> 7;
+  bench_rng ^= bench_rng << 17;
+  return (uint32_t)(bench_rng >> 32);
+}
+/* --< clock >--------------------------------------------------------------- */
+static double
+bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+/* --< prefix length >------------------------------------------------------- */
+/* Roughly the shape of a full table: over half /24, most of the rest
+   /16 - /23, a few short and host routes. */
+static uint8_t
+bench_prefix_len (void)
+{
+  uint32_t r = bench_rand() % 100;
+  if(r < 55) return 24;
+  if(r < 90) return 16 + bench_rand() % 8;
+  if(r < 97) return 8 + bench_rand() % 8;
+  return 25 + bench_rand() % 8;
+}
+/* ---< workload >----------------------------------------------------------- */
+/* --< table >--------------------------------------------------------------- */
+static struct sr_rt *
+bench_table (unsigned int n)
+{
+  struct sr_rt * routes = calloc(n,sizeof(struct sr_rt));
+  unsigned int i;
+  uint8_t len;
+
+  assert(routes);
+  for(i = 0; i < n; i++) {
+    len = bench_prefix_len();
+    routes[i].dest.s_addr = htonl(bench_rand() & SR_FIB_MASK(len));
+    routes[i].mask.s_addr = htonl(SR_FIB_MASK(len));
+    strcpy(routes[i].interface,"eth0");
+    routes[i].next = i + 1 < n ? &(routes[i + 1]) : NULL;
+  }
+  return routes;
+}
+/* --< uniform trace >------------------------------------------------------- */
+/* Half the destinations fall inside a random route, half anywhere. */
+static uint32_t *
+bench_uniform (struct sr_rt * routes, unsigned int nroutes, unsigned int n)
+{
+  uint32_t * dsts = malloc(n * sizeof(uint32_t));
+  struct sr_rt * route;
+  unsigned int i;
+
+  assert(dsts);
+  for(i = 0; i < n; i++) {
+    if(i & 1) {
+      dsts[i] = htonl(bench_rand());
+    } else {
+      route = &(routes[bench_rand() % nroutes]);
+      dsts[i] = route->dest.s_addr | (htonl(bench_rand()) & ~route->mask.s_addr);
+    }
+  }
+  return dsts;
+}
+/* --< zipf trace >---------------------------------------------------------- */
+/* Draws n destinations from a uniform pool of one per route, by rank. */
+static uint32_t *
+bench_zipf (struct sr_rt * routes, unsigned int nroutes, unsigned int n,
+  double s)
+{
+  uint32_t * pool = bench_uniform(routes,nroutes,nroutes);
+  uint32_t * dsts = malloc(n * sizeof(uint32_t));
+  double * cdf = malloc(nroutes * sizeof(double));
+  double sum = 0;
+  double u;
+  unsigned int lo, hi, mid, i;
+
+  assert(dsts && cdf);
+  for(i = 0; i < nroutes; i++) {
+    sum += 1.0 / pow(i + 1,s);
+    cdf[i] = sum;
+  }
+
+  for(i = 0; i < n; i++) {
+    u = (double)bench_rand() / 4294967296.0 * sum;
+    lo = 0;
+    hi = nroutes - 1;
+    while(lo < hi) {
+      mid = (lo + hi) / 2;
+      if(cdf[mid] <= u) lo = mid + 1; else hi = mid;
+    }
+    dsts[i] = pool[lo];
+  }
+
+  free(cdf);
+  free(pool);
+  return dsts;
+}
+/* ---< runs >--------------------------------------------------------------- */
+/* --< one at a time >------------------------------------------------------- */
+static double
+bench_single (struct sr_fib * fib, const uint32_t * dsts, unsigned int n,
+  struct sr_rt ** results)
+{
+  double start = bench_now();
+  unsigned int i;
+
+  for(i = 0; i < n; i++)
+    results[i] = sr_fib_lookup(fib,dsts[i]);
+
+  return bench_now() - start;
+}
+/* --< in bursts >----------------------------------------------------------- */
+static double
+bench_batch (struct sr_fib * fib, const uint32_t * dsts, unsigned int n,
+  unsigned int burst, struct sr_rt ** results)
+{
+  double start = bench_now();
+  unsigned int i;
+
+  for(i = 0; i < n; i += burst)
+    sr_fib_lookup_batch(fib,dsts + i,n - i < burst ? n - i : burst,
+        results + i);
+
+  return bench_now() - start;
+}
+/* --< forwarding path >----------------------------------------------------- */
+/* A router with only the fib, and a cold result cache if cached, looking
+   up the destination of one packet after another. */
+static double
+bench_lpm (struct sr_fib * fib, const uint32_t * dsts, unsigned int n,
+  int cached, struct sr_rt ** results, double * hit)
+{
+  uint8_t packet[sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)];
+  sr_ip_hdr_t * ip = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  struct sr_instance * sr = calloc(1,sizeof(struct sr_instance));
+  double start;
+  double secs;
+  unsigned int i;
+  int idx;
+
+  assert(sr);
+  sr_rcu_init(&(sr->rcu));
+  sr_add_interface(sr,"eth0");
+  sr->vrf[0].fib = fib;
+  if(cached)
+    sr->rt_cache = sr_fib_cache_create();
+  memset(packet,0,sizeof(packet));
+
+  start = bench_now();
+  for(i = 0; i < n; i++) {
+    ip->ip_dst = dsts[i];
+    idx = sr_rcu_read_lock(&(sr->rcu));
+    results[i] = sr_longest_prefix_match(sr,0,packet);
+    sr_rcu_read_unlock(&(sr->rcu),idx);
+  }
+  secs = bench_now() - start;
+
+  *hit = cached ? (double)sr->rt_cache->hits / n : 0;
+  free(sr->rt_cache);
+  free(sr->if_list);
+  free(sr);
+  return secs;
+}
+/* --< report >-------------------------------------------------------------- */
+static void
+bench_report (const char * engine, const char * trace, const char * mode,
+  unsigned int n, double secs)
+{
+  printf("%-6s %-8s %-7s %10.2f Mlookups/s %8.1f ns/lookup",
+      engine,trace,mode,n / secs / 1e6,secs * 1e9 / n);
+}
+/* --< check >--------------------------------------------------------------- */
+static int
+bench_check (const char * engine, const char * mode, unsigned int n,
+  struct sr_rt ** expect, struct sr_rt ** results)
+{
+  unsigned int i;
+
+  for(i = 0; i < n; i++) {
+    if(expect[i] != results[i]) {
+      fprintf(stderr,"%s: %s and single lookups disagree\n",engine,mode);
+      return -1;
+    }
+  }
+  return 0;
+}
+/* --< one table >----------------------------------------------------------- */
+static int
+bench_run (unsigned int nprefixes, unsigned int nlookups, unsigned int burst,
+  int trace, double s)
+{
+  struct sr_rt ** single = malloc(nlookups * sizeof(struct sr_rt *));
+  struct sr_rt ** other = malloc(nlookups * sizeof(struct sr_rt *));
+  struct sr_rt * routes = bench_table(nprefixes);
+  uint32_t * dsts[2];
+  struct sr_fib * fib;
+  unsigned int e, t, i;
+  double secs;
+  double hit;
+  int ret = 0;
+
+  assert(single && other);
+  dsts[0] = trace != 1 ? bench_uniform(routes,nprefixes,nlookups) : NULL;
+  dsts[1] = trace != 0 ? bench_zipf(routes,nprefixes,nlookups,s) : NULL;
+
+  printf("\n%u prefixes, %u lookups, bursts of %u\n",
+      nprefixes,nlookups,burst);
+
+  for(e = sr_fib_engine_trie; e <= sr_fib_engine_dir24 && ret == 0; e++) {
+    secs = bench_now();
+    fib = sr_fib_build(routes,e);
+    secs = bench_now() - secs;
+    printf("%-6s built in %.3f s, %u nodes, %.1f MB\n",bench_engines[e],
+        secs,fib->nnodes,sr_fib_memory(fib) / 1048576.0);
+
+    for(t = 0; t < 2 && ret == 0; t++) {
+      if(dsts[t] == NULL) continue;
+
+      secs = bench_single(fib,dsts[t],nlookups,single);
+      bench_report(bench_engines[e],bench_traces[t],"single",nlookups,secs);
+      printf("\n");
+
+      secs = bench_batch(fib,dsts[t],nlookups,burst,other);
+      bench_report(bench_engines[e],bench_traces[t],"batch",nlookups,secs);
+      printf("\n");
+      ret = bench_check(bench_engines[e],"batch",nlookups,single,other);
+      if(ret) break;
+
+      secs = bench_lpm(fib,dsts[t],nlookups,0,other,&hit);
+      bench_report(bench_engines[e],bench_traces[t],"lpm",nlookups,secs);
+      printf("\n");
+      ret = bench_check(bench_engines[e],"lpm",nlookups,single,other);
+      if(ret) break;
+
+      secs = bench_lpm(fib,dsts[t],nlookups,1,other,&hit);
+      bench_report(bench_engines[e],bench_traces[t],"cached",nlookups,secs);
+      printf(" %5.1f%% hit\n",hit * 100);
+      ret = bench_check(bench_engines[e],"cached",nlookups,single,other);
+    }
+
+    sr_fib_destroy(fib);
+  }
+
+  free(dsts[0]);
+  free(dsts[1]);
+  for(i = 0; i < nprefixes; i++)
+    free(routes[i].nhg);
+  free(routes);
+  free(single);
+  free(other);
+  return ret;
+}
+/* ---< main >--------------------------------------------------------------- */
+int
+main (int argc, char ** argv)
+{
+  unsigned int nprefixes = 0;
+  unsigned int nlookups = BENCH_LOOKUPS;
+  unsigned int burst = BENCH_BURST;
+  double s = BENCH_ZIPF_S;
+  int trace = -1;
+  unsigned int i;
+  int c;
+
+  while((c = getopt(argc,argv,"n:l:b:t:s:")) != -1) {
+    switch(c) {
+      case 'n': nprefixes = atoi(optarg); break;
+      case 'l': nlookups = atoi(optarg); break;
+      case 'b': burst = atoi(optarg); break;
+      case 's': s = atof(optarg); break;
+      case 't':
+        for(trace = 1; trace >= 0; trace--)
+          if(strcmp(optarg,bench_traces[trace]) == 0) break;
+        if(trace >= 0) break;
+        /* fall through */
+      default:
+        fprintf(stderr,"usage: %s [-n prefixes] [-l lookups] [-b burst] "
+            "[-t uniform|zipf] [-s zipf exponent]\n",argv[0]);
+        return 1;
+    }
+  }
+  if(nlookups == 0 || burst == 0 || s <= 0) {
+    fprintf(stderr,"lookups, burst and zipf exponent must be positive\n");
+    return 1;
+  }
+
+  if(nprefixes)
+    return bench_run(nprefixes,nlookups,burst,trace,s) ? 1 : 0;
+
+  for(i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++)
+    if(bench_run(bench_sizes[i],nlookups,burst,trace,s) != 0)
+      return 1;
+  return 0;
+}
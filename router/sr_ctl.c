@@ -0,0 +1,262 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "sr_ctl.h"
+#include "sr_fib.h"
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+
+/* updates applied before the unlinked memory is freed, so a client that
+   never hangs up can't pile up an unbounded amount of it */
+#define SR_CTL_BATCH 1024
+
+struct sr_ctl {
+  struct sr_instance * sr;
+  int fd;                        /* listening socket */
+};
+
+/* ---< private functions >-------------------------------------------------- */
+/* --< add >----------------------------------------------------------------- */
+static void
+sr_ctl_add (struct sr_instance * sr, FILE * out, char * args)
+{
+  char dest[32], gw[32], mask[32], iface[32], word[8];
+  struct in_addr dest_addr, gw_addr, mask_addr;
+  unsigned int vrf = 0;
+  int ecmp = 0;
+  int off;
+
+  if(sscanf(args,"%31s %31s %31s %31s%n",dest,gw,mask,iface,&off) < 4) {
+    fprintf(out,"error usage: add <dest> <gw> <mask> <iface> [vrf] [ecmp]\n");
+    return;
+  }
+  args += off;
+  if(sscanf(args,"%u%n",&vrf,&off) == 1)
+    args += off;
+  if(sscanf(args,"%7s",word) == 1) {
+    if(strcmp(word,"ecmp") != 0) {
+      fprintf(out,"error usage: add <dest> <gw> <mask> <iface> [vrf] [ecmp]\n");
+      return;
+    }
+    ecmp = 1;
+  }
+  if(vrf >= SR_VRF_MAX) {
+    fprintf(out,"error no vrf %u\n",vrf);
+    return;
+  }
+  if(inet_aton(dest,&dest_addr) == 0 || inet_aton(gw,&gw_addr) == 0
+      || inet_aton(mask,&mask_addr) == 0) {
+    fprintf(out,"error bad address\n");
+    return;
+  }
+  if(sr_get_interface(sr,iface) == NULL) {
+    fprintf(out,"error no interface %s\n",iface);
+    return;
+  }
+
+  sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface,vrf,ecmp);
+  fprintf(out,"ok\n");
+}
+/* --< del >----------------------------------------------------------------- */
+static void
+sr_ctl_del (struct sr_instance * sr, FILE * out, char * args)
+{
+  char dest[32], mask[32];
+  struct in_addr dest_addr, mask_addr;
+  unsigned int vrf = 0;
+
+  if(sscanf(args,"%31s %31s %u",dest,mask,&vrf) < 2) {
+    fprintf(out,"error usage: del <dest> <mask> [vrf]\n");
+    return;
+  }
+  if(vrf >= SR_VRF_MAX) {
+    fprintf(out,"error no vrf %u\n",vrf);
+    return;
+  }
+  if(inet_aton(dest,&dest_addr) == 0 || inet_aton(mask,&mask_addr) == 0) {
+    fprintf(out,"error bad address\n");
+    return;
+  }
+
+  if(sr_del_rt_entry(sr,dest_addr,mask_addr,vrf) != 0)
+    fprintf(out,"error no such route\n");
+  else
+    fprintf(out,"ok\n");
+}
+/* --< stats >--------------------------------------------------------------- */
+static void
+sr_ctl_stats (struct sr_instance * sr, FILE * out)
+{
+  unsigned int nvrfs = 0;
+  unsigned int nroutes = 0;
+  unsigned int nnodes = 0;
+  unsigned int i;
+
+  pthread_mutex_lock(&(sr->rt_lock));
+  for(i = 0; i < SR_VRF_MAX; i++) {
+    if(sr->vrf[i].fib == NULL) continue;
+    nvrfs++;
+    nroutes += sr->vrf[i].fib->nroutes;
+    nnodes += sr->vrf[i].fib->nnodes;
+  }
+  pthread_mutex_unlock(&(sr->rt_lock));
+
+  fprintf(out,"ok engine %s vrfs %u routes %u nodes %u",
+      sr->fib_engine == sr_fib_engine_dir24 ? "dir24" : "trie",
+      nvrfs,nroutes,nnodes);
+  if(sr->rt_cache)
+    fprintf(out," cache_hits %lu cache_misses %lu",
+        sr->rt_cache->hits,sr->rt_cache->misses);
+  fprintf(out,"\n");
+}
+/* --< counters >------------------------------------------------------------ */
+/* One line per next hop, then ok. */
+static void
+sr_ctl_counters (struct sr_instance * sr, FILE * out)
+{
+  char dest[INET_ADDRSTRLEN], mask[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
+  struct sr_rt * route;
+  unsigned int i;
+
+  pthread_mutex_lock(&(sr->rt_lock));
+  for(i = 0; i < SR_VRF_MAX; i++) {
+    for(route = sr->vrf[i].routing_table; route; route = route->next) {
+      inet_ntop(AF_INET,&(route->dest),dest,sizeof(dest));
+      inet_ntop(AF_INET,&(route->mask),mask,sizeof(mask));
+      inet_ntop(AF_INET,&(route->gw),gw,sizeof(gw));
+      fprintf(out,"%u %s %s %s %s packets %lu bytes %lu\n",
+          i,dest,mask,gw,route->interface,
+          __atomic_load_n(&(route->packets),__ATOMIC_RELAXED),
+          __atomic_load_n(&(route->bytes),__ATOMIC_RELAXED));
+    }
+  }
+  pthread_mutex_unlock(&(sr->rt_lock));
+  fprintf(out,"ok\n");
+}
+/* --< client >-------------------------------------------------------------- */
+static void
+sr_ctl_serve (struct sr_instance * sr, int fd)
+{
+  char line[BUFSIZ];
+  char cmd[16];
+  int off;
+  int pending = 0;
+  FILE * in = fdopen(fd,"r");
+  FILE * out = fdopen(dup(fd),"w");
+
+  if(in == NULL || out == NULL) {
+    if(in) fclose(in); else close(fd);
+    if(out) fclose(out);
+    return;
+  }
+  setvbuf(out,NULL,_IOLBF,0);
+
+  while(fgets(line,sizeof(line),in)) {
+    if(sscanf(line,"%15s%n",cmd,&off) != 1)
+      continue;
+
+    if(strcmp(cmd,"add") == 0) {
+      sr_ctl_add(sr,out,line + off);
+      pending++;
+    } else if(strcmp(cmd,"del") == 0) {
+      sr_ctl_del(sr,out,line + off);
+      pending++;
+    } else if(strcmp(cmd,"stats") == 0) {
+      sr_ctl_stats(sr,out);
+    } else if(strcmp(cmd,"counters") == 0) {
+      sr_ctl_counters(sr,out);
+    } else {
+      fprintf(out,"error unknown command %s\n",cmd);
+    }
+
+    if(pending == SR_CTL_BATCH) {
+      sr_rt_commit(sr);
+      pending = 0;
+    }
+  }
+
+  if(pending)
+    sr_rt_commit(sr);
+
+  fclose(out);
+  fclose(in);
+}
+/* --< thread >-------------------------------------------------------------- */
+static void *
+sr_ctl_thread (void * arg)
+{
+  struct sr_ctl * ctl = arg;
+  sigset_t set;
+  int fd;
+
+  /* a client hanging up early must not take the router down */
+  sigemptyset(&set);
+  sigaddset(&set,SIGPIPE);
+  pthread_sigmask(SIG_BLOCK,&set,NULL);
+
+  while(1) {
+    fd = accept(ctl->fd,NULL,NULL);
+    if(fd < 0) {
+      perror("accept");
+      continue;
+    }
+    sr_ctl_serve(ctl->sr,fd);
+  }
+
+  return NULL;
+}
+/* ---< public functions >--------------------------------------------------- */
+int
+sr_ctl_start (struct sr_instance * sr, const char * path)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  struct sr_ctl * ctl;
+  pthread_t thread;
+  int fd;
+
+  assert(sr);
+  assert(path);
+
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr,"Control socket path too long: %s\n",path);
+    return -1;
+  }
+
+  fd = socket(AF_UNIX,SOCK_STREAM,0);
+  if(fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path,path);
+  /* -- only a socket left by an earlier run is ours to replace -- */
+  if(lstat(path,&st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  if(bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0
+      || listen(fd,4) < 0) {
+    perror("control socket");
+    close(fd);
+    return -1;
+  }
+
+  ctl = malloc(sizeof(struct sr_ctl));
+  assert(ctl);
+  ctl->sr = sr;
+  ctl->fd = fd;
+  pthread_create(&thread,&(sr->attr),sr_ctl_thread,ctl);
+
+  return 0;
+}
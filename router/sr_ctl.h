@@ -0,0 +1,39 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ctl.h
+ *
+ * Description:
+ *
+ * Local control socket for changing routes while the router runs. A client
+ * connects to the unix socket given with -c, writes one command per line
+ * and gets one reply line per command, "ok" or "error <reason>":
+ *
+ *   add <dest> <gw> <mask> <iface> [vrf] [ecmp]
+ *   del <dest> <mask> [vrf]
+ *   stats
+ *   counters
+ *
+ * Routes go in vrf 0 unless another is given. add replaces every next hop
+ * of the prefix, or with ecmp adds one to them, so equal cost groups can
+ * be built a next hop at a time. del withdraws them all. counters first
+ * writes a line per next hop,
+ * "<vrf> <dest> <mask> <gw> <iface> packets <n> bytes <n>", so the spread
+ * over an equal cost group can be checked.
+ *
+ * Updates are applied in place as they arrive. The memory they unlink is
+ * freed after every 1024 updates and when the client disconnects, so a
+ * batch of updates sent over one connection waits for one grace period
+ * per 1024 rather than one each.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_CTL_H
+#define SR_CTL_H
+
+struct sr_instance;
+
+/* Listens on path, replacing any stale socket there, and serves clients
+   from a new thread. Returns 0 on success, -1 if the socket can't be set
+   up, as when something other than a socket is at path. */
+int sr_ctl_start(struct sr_instance * sr, const char * path);
+
+#endif /* -- SR_CTL_H -- */
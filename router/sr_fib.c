@@ -0,0 +1,819 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_fib.h"
+
+/* last generation handed to a fib, 0 is reserved for empty cache entries */
+static uint32_t sr_fib_generation = 0;
+
+/* a route keyed by prefix, then length, for sorting into insertion order */
+struct sr_fib_order {
+  uint64_t key;
+  struct sr_rt * route;
+};
+
+/* Image of a fib, see sr_fib_save: a header, then the trie in preorder,
+   each node followed by the routes it carries, then whatever the engine
+   adds. Addresses in routes are kept in network byte order as in struct
+   sr_rt, everything else in host byte order. */
+struct sr_fib_image_hdr {
+  uint32_t engine;
+  uint32_t nnodes;
+  uint32_t nhops;                /* route records */
+  uint32_t ngroups;              /* nodes with more than one */
+  uint32_t ngrouped;             /* route records of those nodes */
+};
+
+struct sr_fib_image_node {
+  uint32_t prefix;
+  uint32_t idx;                  /* dir24 route index */
+  uint32_t nh;                   /* routes that follow, the one the node
+                                    carries and the rest of its group */
+  uint8_t len;
+  uint8_t children;              /* bit n is set if child[n] follows */
+  uint8_t pad[2];
+};
+
+struct sr_fib_image_route {
+  uint32_t dest;
+  uint32_t gw;
+  uint32_t mask;
+  char interface[sr_IFACE_NAMELEN];
+};
+
+/* where sr_fib_load is in the image, the routes it has made, and what is
+   left of the room the header gave each kind of object in the arena */
+struct sr_fib_image_in {
+  const unsigned char * pos;
+  const unsigned char * end;
+  struct sr_rt * routes;
+  struct sr_rt * last;
+  struct sr_fib_node * node;     /* next free one in the arena */
+  struct sr_rt * route;
+  unsigned char * nhg;
+  uint32_t nnodes;               /* free ones from there */
+  uint32_t nhops;
+  uint32_t ngroups;
+  uint32_t ngrouped;
+};
+
+/* ---< private functions >-------------------------------------------------- */
+/* --< next generation >----------------------------------------------------- */
+static uint32_t
+sr_fib_next_generation (void)
+{
+  uint32_t gen;
+  do {
+    gen = __sync_add_and_fetch(&sr_fib_generation,1);
+  } while(gen == 0);
+  return gen;
+}
+/* --< node allocator >------------------------------------------------------ */
+static struct sr_fib_node *
+sr_fib_new_node (struct sr_fib * fib,
+  uint32_t prefix,
+  uint8_t len,
+  struct sr_rt * route)
+{
+  struct sr_fib_node * node = malloc(sizeof(struct sr_fib_node));
+  assert(node);
+  node->prefix = prefix;
+  node->len = len;
+  node->arena = 0;
+  node->idx = 0;
+  node->route = route;
+  node->child[0] = NULL;
+  node->child[1] = NULL;
+  fib->nnodes++;
+  return node;
+}
+/* --< free subtree >-------------------------------------------------------- */
+static void
+sr_fib_free_node (struct sr_fib_node * node)
+{
+  if(node == NULL) return;
+  sr_fib_free_node(node->child[0]);
+  sr_fib_free_node(node->child[1]);
+  if(!node->arena)
+    free(node);
+}
+/* --< common prefix length >------------------------------------------------ */
+static uint8_t
+sr_fib_common_len (uint32_t a, uint32_t b)
+{
+  uint32_t diff = a ^ b;
+  if(diff == 0) return 32;
+  return __builtin_clz(diff);
+}
+/* --< trie insert >--------------------------------------------------------- */
+/* Links route into the trie and returns the node that carries it. Sets
+   replaced to the route it displaced, if any. Every node is complete before
+   the store that makes it reachable. */
+static struct sr_fib_node *
+sr_fib_trie_insert (struct sr_fib * fib,
+  struct sr_rt * route,
+  struct sr_rt ** replaced)
+{
+  uint8_t len = sr_fib_mask_len(route->mask);
+  uint32_t prefix = ntohl(route->dest.s_addr) & SR_FIB_MASK(len);
+  struct sr_fib_node ** slot = &(fib->root);
+  struct sr_fib_node * node;
+  struct sr_fib_node * leaf;
+  struct sr_fib_node * glue;
+  uint8_t common;
+
+  *replaced = NULL;
+
+  while((node = *slot) != NULL) {
+    common = sr_fib_common_len(node->prefix,prefix);
+    if(common > len) common = len;
+
+    if(common < node->len) {
+      /* node diverges from or is more specific than the new prefix */
+      leaf = sr_fib_new_node(fib,prefix,len,route);
+      if(common == len) {
+        leaf->child[SR_FIB_BIT(node->prefix,len)] = node;
+        sr_rcu_assign_pointer(*slot,leaf);
+      } else {
+        glue = sr_fib_new_node(fib,prefix & SR_FIB_MASK(common),common,NULL);
+        glue->child[SR_FIB_BIT(prefix,common)] = leaf;
+        glue->child[SR_FIB_BIT(node->prefix,common)] = node;
+        sr_rcu_assign_pointer(*slot,glue);
+      }
+      fib->nroutes++;
+      return leaf;
+    }
+
+    if(node->len == len) {
+      if(node->route == NULL) fib->nroutes++;
+      *replaced = node->route;
+      sr_rcu_assign_pointer(node->route,route);
+      return node;
+    }
+
+    slot = &(node->child[SR_FIB_BIT(prefix,node->len)]);
+  }
+
+  leaf = sr_fib_new_node(fib,prefix,len,route);
+  sr_rcu_assign_pointer(*slot,leaf);
+  fib->nroutes++;
+  return leaf;
+}
+/* --< equal cost group >---------------------------------------------------- */
+/* Adds route to the next hops of head, the route already in the trie for
+   the same prefix. */
+static void
+sr_fib_group (struct sr_rt * head, struct sr_rt * route)
+{
+  struct sr_nhg * nhg = head->nhg;
+  unsigned int cap;
+
+  if(nhg == NULL || nhg->n == nhg->cap) {
+    cap = nhg ? nhg->cap * 2 : 4;
+    nhg = realloc(nhg,sizeof(struct sr_nhg)
+        + (cap - 1) * sizeof(struct sr_rt *));
+    assert(nhg);
+    if(head->nhg == NULL) {
+      nhg->n = 1;
+      nhg->arena = 0;
+      nhg->nh[0] = head;
+    }
+    nhg->cap = cap;
+    head->nhg = nhg;
+  }
+
+  nhg->nh[nhg->n++] = route;
+}
+/* --< build order >--------------------------------------------------------- */
+/* Sorts by prefix, then length, which is the trie in preorder. A radix sort
+   is stable, so the first route in the list for a prefix still leads its
+   group. Returns whichever of the two arrays ends up sorted. */
+static struct sr_fib_order *
+sr_fib_sort (struct sr_fib_order * order, struct sr_fib_order * tmp,
+  unsigned int n)
+{
+  struct sr_fib_order * swap;
+  unsigned int count[256];
+  unsigned int shift, sum, c, i;
+
+  for(shift = 0; shift < 40 && n; shift += 8) {
+    memset(count,0,sizeof(count));
+    for(i = 0; i < n; i++)
+      count[(order[i].key >> shift) & 0xff]++;
+    if(count[(order[0].key >> shift) & 0xff] == n) continue;
+
+    for(sum = 0, i = 0; i < 256; i++) {
+      c = count[i];
+      count[i] = sum;
+      sum += c;
+    }
+    for(i = 0; i < n; i++)
+      tmp[count[(order[i].key >> shift) & 0xff]++] = order[i];
+    swap = order;
+    order = tmp;
+    tmp = swap;
+  }
+  return order;
+}
+/* --< image count >-------------------------------------------------------- */
+/* Sizes the arena sr_fib_load will need for the subtree at node. */
+static void
+sr_fib_image_count (struct sr_fib_node * node, struct sr_fib_image_hdr * hdr)
+{
+  unsigned int n;
+
+  if(node == NULL) return;
+  if(node->route) {
+    n = node->route->nhg ? node->route->nhg->n : 1;
+    hdr->nhops += n;
+    if(n > 1) {
+      hdr->ngroups++;
+      hdr->ngrouped += n;
+    }
+  }
+  sr_fib_image_count(node->child[0],hdr);
+  sr_fib_image_count(node->child[1],hdr);
+}
+/* --< image save >-------------------------------------------------------- */
+static int
+sr_fib_image_save_node (struct sr_fib_node * node, FILE * fp)
+{
+  struct sr_fib_image_node rec;
+  struct sr_fib_image_route rt;
+  struct sr_rt * route;
+  unsigned int i;
+
+  memset(&rec,0,sizeof(rec));
+  rec.prefix = node->prefix;
+  rec.idx = node->idx;
+  rec.len = node->len;
+  if(node->route)
+    rec.nh = node->route->nhg ? node->route->nhg->n : 1;
+  rec.children = (node->child[0] ? 1 : 0) | (node->child[1] ? 2 : 0);
+  if(fwrite(&rec,sizeof(rec),1,fp) != 1) return -1;
+
+  for(i = 0; i < rec.nh; i++) {
+    route = node->route->nhg ? node->route->nhg->nh[i] : node->route;
+    memset(&rt,0,sizeof(rt));
+    rt.dest = route->dest.s_addr;
+    rt.gw = route->gw.s_addr;
+    rt.mask = route->mask.s_addr;
+    strncpy(rt.interface,route->interface,sr_IFACE_NAMELEN);
+    if(fwrite(&rt,sizeof(rt),1,fp) != 1) return -1;
+  }
+
+  if(node->child[0] && sr_fib_image_save_node(node->child[0],fp) != 0)
+    return -1;
+  if(node->child[1] && sr_fib_image_save_node(node->child[1],fp) != 0)
+    return -1;
+  return 0;
+}
+/* --< image read >---------------------------------------------------------- */
+static int
+sr_fib_image_read (struct sr_fib_image_in * in, void * dst, size_t len)
+{
+  if((size_t)(in->end - in->pos) < len) return -1;
+  memcpy(dst,in->pos,len);
+  in->pos += len;
+  return 0;
+}
+/* --< image load >---------------------------------------------------------- */
+/* Reads the subtree that goes in slot, child[bit] of parent, taking every
+   object from the arena, so a failed load is freed with the fib. A node
+   must lie below its parent, which also bounds the depth, and none may
+   take more room than the header gave. */
+static int
+sr_fib_image_load_node (struct sr_fib * fib,
+  struct sr_fib_image_in * in,
+  struct sr_fib_node * parent,
+  unsigned int bit,
+  struct sr_fib_node ** slot)
+{
+  struct sr_fib_image_node rec;
+  struct sr_fib_image_route rt;
+  struct sr_fib_node * node;
+  struct sr_nhg * nhg = NULL;
+  struct sr_rt * route;
+  uint32_t i;
+
+  if(sr_fib_image_read(in,&rec,sizeof(rec)) != 0) return -1;
+  if(rec.len > 32 || (rec.prefix & ~SR_FIB_MASK(rec.len)) != 0) return -1;
+  if(parent && (rec.len <= parent->len
+        || (rec.prefix & SR_FIB_MASK(parent->len)) != parent->prefix
+        || SR_FIB_BIT(rec.prefix,parent->len) != bit))
+    return -1;
+
+  if(in->nnodes == 0 || rec.nh > in->nhops) return -1;
+  node = in->node++;
+  in->nnodes--;
+  node->prefix = rec.prefix;
+  node->len = rec.len;
+  node->arena = 1;
+  node->idx = rec.idx;
+  node->route = NULL;
+  node->child[0] = NULL;
+  node->child[1] = NULL;
+  fib->nnodes++;
+  *slot = node;
+
+  if(rec.nh > 1) {
+    if(in->ngroups == 0 || rec.nh > in->ngrouped) return -1;
+    nhg = (struct sr_nhg *)in->nhg;
+    in->nhg += sizeof(struct sr_nhg) + (rec.nh - 1) * sizeof(struct sr_rt *);
+    in->ngroups--;
+    in->ngrouped -= rec.nh;
+    nhg->n = rec.nh;
+    nhg->cap = rec.nh;
+    nhg->arena = 1;
+  }
+
+  for(i = 0; i < rec.nh; i++) {
+    if(sr_fib_image_read(in,&rt,sizeof(rt)) != 0) return -1;
+    route = in->route++;
+    in->nhops--;
+    route->dest.s_addr = rt.dest;
+    route->gw.s_addr = rt.gw;
+    route->mask.s_addr = rt.mask;
+    memcpy(route->interface,rt.interface,sr_IFACE_NAMELEN);
+    route->interface[sr_IFACE_NAMELEN - 1] = 0;
+    route->next = NULL;
+    route->prev = in->last;
+    route->adj = NULL;
+    route->nhg = NULL;
+    route->packets = 0;
+    route->bytes = 0;
+    route->arena = 1;
+    if(in->last) in->last->next = route; else in->routes = route;
+    in->last = route;
+
+    if(sr_fib_mask_len(route->mask) != rec.len
+        || (ntohl(route->dest.s_addr) & SR_FIB_MASK(rec.len)) != rec.prefix)
+      return -1;
+    if(nhg)
+      nhg->nh[i] = route;
+    if(i == 0) {
+      node->route = route;
+      route->nhg = nhg;
+      fib->nroutes++;
+    }
+  }
+
+  if((rec.children & 1)
+      && sr_fib_image_load_node(fib,in,node,0,&(node->child[0])) != 0)
+    return -1;
+  if((rec.children & 2)
+      && sr_fib_image_load_node(fib,in,node,1,&(node->child[1])) != 0)
+    return -1;
+  return 0;
+}
+/* --< retire >-------------------------------------------------------------- */
+static void
+sr_fib_retire (struct sr_rcu * rcu, void * p)
+{
+  if(rcu)
+    sr_rcu_defer_free(rcu,p);
+  else
+    free(p);
+}
+/* ---< public functions >--------------------------------------------------- */
+/* --< mask length >--------------------------------------------------------- */
+uint8_t
+sr_fib_mask_len (struct in_addr mask)
+{
+  uint32_t inverted = ~ntohl(mask.s_addr);
+  if(inverted == 0) return 32;
+  return __builtin_clz(inverted);
+}
+/* --< insert >-------------------------------------------------------------- */
+struct sr_rt *
+sr_fib_insert (struct sr_fib * fib, struct sr_rt * route, struct sr_rcu * rcu)
+{
+  struct sr_rt * replaced;
+  struct sr_fib_node * node = sr_fib_trie_insert(fib,route,&replaced);
+
+  if(fib->engine == sr_fib_engine_dir24)
+    sr_fib_dir24_insert(fib,node,replaced,rcu);
+
+  __atomic_store_n(&(fib->gen),sr_fib_next_generation(),__ATOMIC_RELEASE);
+  return replaced;
+}
+/* --< append >-------------------------------------------------------------- */
+void
+sr_fib_append (struct sr_fib * fib, struct sr_rt * route, struct sr_rcu * rcu)
+{
+  uint8_t len = sr_fib_mask_len(route->mask);
+  uint32_t prefix = ntohl(route->dest.s_addr) & SR_FIB_MASK(len);
+  struct sr_fib_node * node = fib->root;
+  struct sr_rt * head;
+  struct sr_nhg * old;
+  struct sr_nhg * nhg;
+  unsigned int n;
+
+  while(node && node->len < len
+      && (prefix & SR_FIB_MASK(node->len)) == node->prefix)
+    node = node->child[SR_FIB_BIT(prefix,node->len)];
+  if(node == NULL || node->len != len || node->prefix != prefix
+      || node->route == NULL) {
+    sr_fib_insert(fib,route,rcu);
+    return;
+  }
+
+  /* readers may be picking a member of the old group, so it is copied
+     with route added and the copy published in its place */
+  head = node->route;
+  old = head->nhg;
+  n = old ? old->n : 1;
+  nhg = malloc(sizeof(struct sr_nhg) + n * sizeof(struct sr_rt *));
+  assert(nhg);
+  if(old)
+    memcpy(nhg->nh,old->nh,n * sizeof(struct sr_rt *));
+  else
+    nhg->nh[0] = head;
+  nhg->nh[n] = route;
+  nhg->n = n + 1;
+  nhg->cap = n + 1;
+  nhg->arena = 0;
+  sr_rcu_assign_pointer(head->nhg,nhg);
+  if(old && !old->arena)
+    sr_rcu_defer_free(rcu,old);
+
+  __atomic_store_n(&(fib->gen),sr_fib_next_generation(),__ATOMIC_RELEASE);
+}
+/* --< remove >-------------------------------------------------------------- */
+struct sr_rt *
+sr_fib_remove (struct sr_fib * fib,
+  struct in_addr dest,
+  struct in_addr mask,
+  struct sr_rcu * rcu)
+{
+  uint8_t len = sr_fib_mask_len(mask);
+  uint32_t prefix = ntohl(dest.s_addr) & SR_FIB_MASK(len);
+  struct sr_fib_node ** slot = &(fib->root);
+  struct sr_fib_node ** parent_slot = NULL;
+  struct sr_fib_node * parent = NULL;
+  struct sr_fib_node * cover = NULL;
+  struct sr_fib_node * node;
+  struct sr_fib_node * child;
+  struct sr_rt * route;
+
+  while((node = *slot) != NULL) {
+    if(node->len > len) return NULL;
+    if((prefix & SR_FIB_MASK(node->len)) != node->prefix) return NULL;
+    if(node->len == len) break;
+    if(node->route) cover = node;
+    parent_slot = slot;
+    parent = node;
+    slot = &(node->child[SR_FIB_BIT(prefix,node->len)]);
+  }
+  if(node == NULL || node->route == NULL) return NULL;
+
+  route = node->route;
+  if(fib->engine == sr_fib_engine_dir24)
+    sr_fib_dir24_remove(fib,node,cover);
+  fib->nroutes--;
+
+  if(node->child[0] && node->child[1]) {
+    /* still joins two subtrees */
+    sr_rcu_assign_pointer(node->route,NULL);
+  } else {
+    child = node->child[0] ? node->child[0] : node->child[1];
+    sr_rcu_assign_pointer(*slot,child);
+    if(!node->arena)
+      sr_fib_retire(rcu,node);
+    fib->nnodes--;
+
+    if(child == NULL && parent && parent->route == NULL) {
+      /* parent was only joining node to its sibling */
+      child = parent->child[0] ? parent->child[0] : parent->child[1];
+      sr_rcu_assign_pointer(*parent_slot,child);
+      if(!parent->arena)
+        sr_fib_retire(rcu,parent);
+      fib->nnodes--;
+    }
+  }
+
+  __atomic_store_n(&(fib->gen),sr_fib_next_generation(),__ATOMIC_RELEASE);
+  return route;
+}
+/* --< recycle >------------------------------------------------------------- */
+void
+sr_fib_recycle (struct sr_fib * fib)
+{
+  if(fib->engine == sr_fib_engine_dir24)
+    sr_fib_dir24_recycle(fib);
+}
+/* --< memory >-------------------------------------------------------------- */
+size_t
+sr_fib_memory (struct sr_fib * fib)
+{
+  size_t bytes = sizeof(struct sr_fib)
+    + (size_t)fib->nnodes * sizeof(struct sr_fib_node);
+
+  if(fib->engine == sr_fib_engine_dir24) {
+    bytes += (size_t)SR_DIR24_TBL24_SZ * sizeof(uint32_t);
+    bytes += (size_t)fib->tbl8_cap * SR_DIR24_TBL8_SZ * sizeof(uint32_t);
+    bytes += (size_t)fib->rtv_cap * sizeof(struct sr_rt *);
+    bytes += (size_t)fib->idx_cap * 2 * sizeof(uint32_t);
+  }
+  return bytes;
+}
+/* --< engine name >--------------------------------------------------------- */
+int
+sr_fib_parse_engine (const char * name, enum sr_fib_engine * engine)
+{
+  if(strcmp(name,"trie") == 0) {
+    *engine = sr_fib_engine_trie;
+    return 0;
+  }
+  if(strcmp(name,"dir24") == 0) {
+    *engine = sr_fib_engine_dir24;
+    return 0;
+  }
+  return -1;
+}
+/* --< lookup >-------------------------------------------------------------- */
+struct sr_rt *
+sr_fib_lookup (struct sr_fib * fib, uint32_t ip)
+{
+  struct sr_fib_node * node;
+  struct sr_rt * best = NULL;
+  struct sr_rt * route;
+  uint32_t key = ntohl(ip);
+
+  if(fib->engine == sr_fib_engine_dir24)
+    return sr_fib_dir24_lookup(fib,ip);
+
+  node = sr_rcu_dereference(fib->root);
+  while(node) {
+    if((key & SR_FIB_MASK(node->len)) != node->prefix) break;
+    route = sr_rcu_dereference(node->route);
+    if(route) best = route;
+    if(node->len == 32) break;
+    node = sr_rcu_dereference(node->child[SR_FIB_BIT(key,node->len)]);
+  }
+
+  return best;
+}
+/* --< batch lookup >-------------------------------------------------------- */
+void
+sr_fib_lookup_batch (struct sr_fib * fib,
+  const uint32_t * dsts,
+  unsigned int n,
+  struct sr_rt ** results)
+{
+  struct sr_fib_node * node[SR_FIB_BATCH];
+  uint32_t key[SR_FIB_BATCH];
+  struct sr_rt * route;
+  unsigned int base, count, active, i;
+
+  if(fib->engine == sr_fib_engine_dir24) {
+    sr_fib_dir24_lookup_batch(fib,dsts,n,results);
+    return;
+  }
+
+  for(base = 0; base < n; base += count) {
+    count = n - base < SR_FIB_BATCH ? n - base : SR_FIB_BATCH;
+
+    for(i = 0; i < count; i++) {
+      key[i] = ntohl(dsts[base + i]);
+      node[i] = sr_rcu_dereference(fib->root);
+      results[base + i] = NULL;
+    }
+
+    /* one level of every walk per pass; the child a walk moves to is
+       prefetched a whole pass before it is read */
+    do {
+      active = 0;
+      for(i = 0; i < count; i++) {
+        if(node[i] == NULL) continue;
+        if((key[i] & SR_FIB_MASK(node[i]->len)) != node[i]->prefix) {
+          node[i] = NULL;
+          continue;
+        }
+        route = sr_rcu_dereference(node[i]->route);
+        if(route) results[base + i] = route;
+        if(node[i]->len == 32) {
+          node[i] = NULL;
+          continue;
+        }
+        node[i] = sr_rcu_dereference(
+            node[i]->child[SR_FIB_BIT(key[i],node[i]->len)]);
+        if(node[i]) {
+          __builtin_prefetch(node[i]);
+          active++;
+        }
+      }
+    } while(active);
+  }
+}
+/* --< constructor >--------------------------------------------------------- */
+struct sr_fib *
+sr_fib_build (struct sr_rt * routes, enum sr_fib_engine engine)
+{
+  struct sr_fib * fib = calloc(1,sizeof(struct sr_fib));
+  struct sr_fib_order * order;
+  struct sr_fib_order * sorted;
+  struct sr_fib_node * node;
+  struct sr_rt * replaced;
+  struct sr_rt * route;
+  unsigned int n = 0;
+  unsigned int i;
+  uint8_t len;
+  assert(fib);
+  fib->engine = engine;
+  fib->gen = sr_fib_next_generation();
+
+  /* inserting in preorder keeps the path each insert walks in cache,
+     where list order sends every one of them through cold nodes */
+  for(route = routes; route; route = route->next) {
+    /* -- groups are rebuilt from the list each time, not grown -- */
+    if(route->nhg && !route->nhg->arena)
+      free(route->nhg);
+    route->nhg = NULL;
+    n++;
+  }
+  order = malloc((n ? 2 * n : 1) * sizeof(struct sr_fib_order));
+  assert(order);
+  for(route = routes, i = 0; route; route = route->next, i++) {
+    len = sr_fib_mask_len(route->mask);
+    order[i].key = (uint64_t)(ntohl(route->dest.s_addr) & SR_FIB_MASK(len)) << 8
+      | len;
+    order[i].route = route;
+  }
+  sorted = sr_fib_sort(order,order + n,n);
+
+  for(i = 0; i < n; i++) {
+    node = sr_fib_trie_insert(fib,sorted[i].route,&replaced);
+    if(replaced) {
+      /* a second route for the prefix is another next hop, not a
+         replacement; the trie keeps the first */
+      node->route = replaced;
+      sr_fib_group(replaced,sorted[i].route);
+    }
+  }
+  free(order);
+
+  if(engine == sr_fib_engine_dir24)
+    sr_fib_dir24_build(fib);
+
+  return fib;
+}
+/* --< destructor >---------------------------------------------------------- */
+void
+sr_fib_destroy (struct sr_fib * fib)
+{
+  if(fib == NULL) return;
+  if(fib->engine == sr_fib_engine_dir24)
+    sr_fib_dir24_destroy(fib);
+  sr_fib_free_node(fib->root);
+  free(fib->arena);
+  free(fib);
+}
+/* ---< image >-------------------------------------------------------------- */
+/* --< save >---------------------------------------------------------------- */
+int
+sr_fib_save (struct sr_fib * fib, FILE * fp)
+{
+  struct sr_fib_image_hdr hdr;
+
+  hdr.engine = fib->engine;
+  hdr.nnodes = fib->nnodes;
+  hdr.nhops = 0;
+  hdr.ngroups = 0;
+  hdr.ngrouped = 0;
+  sr_fib_image_count(fib->root,&hdr);
+
+  if(fwrite(&hdr,sizeof(hdr),1,fp) != 1) return -1;
+  if(fib->root && sr_fib_image_save_node(fib->root,fp) != 0) return -1;
+  if(fib->engine == sr_fib_engine_dir24)
+    return sr_fib_dir24_save(fib,fp);
+  return 0;
+}
+/* --< load >---------------------------------------------------------------- */
+struct sr_fib *
+sr_fib_load (const unsigned char ** pos,
+  const unsigned char * end,
+  enum sr_fib_engine engine,
+  struct sr_rt ** routes)
+{
+  struct sr_fib_image_hdr hdr;
+  struct sr_fib_image_in in;
+  struct sr_fib * fib;
+  size_t nodes_len, routes_len, groups_len;
+
+  *routes = NULL;
+  in.pos = *pos;
+  in.end = end;
+  in.routes = NULL;
+  in.last = NULL;
+  if(sr_fib_image_read(&in,&hdr,sizeof(hdr)) != 0) return NULL;
+  if(hdr.engine != engine) return NULL;
+  /* -- every object has a record, so the image bounds the arena -- */
+  if(hdr.nnodes > (size_t)(end - in.pos) / sizeof(struct sr_fib_image_node)
+      || hdr.nhops > (size_t)(end - in.pos) / sizeof(struct sr_fib_image_route)
+      || hdr.ngroups > hdr.nnodes || hdr.ngrouped > hdr.nhops)
+    return NULL;
+
+  fib = calloc(1,sizeof(struct sr_fib));
+  assert(fib);
+  fib->engine = engine;
+  fib->gen = sr_fib_next_generation();
+
+  nodes_len = (size_t)hdr.nnodes * sizeof(struct sr_fib_node);
+  routes_len = (size_t)hdr.nhops * sizeof(struct sr_rt);
+  groups_len = (size_t)hdr.ngroups * (sizeof(struct sr_nhg)
+      - sizeof(struct sr_rt *)) + (size_t)hdr.ngrouped * sizeof(struct sr_rt *);
+  if(nodes_len + routes_len + groups_len) {
+    fib->arena = malloc(nodes_len + routes_len + groups_len);
+    assert(fib->arena);
+  }
+  in.node = fib->arena;
+  in.route = (struct sr_rt *)((unsigned char *)fib->arena + nodes_len);
+  in.nhg = (unsigned char *)fib->arena + nodes_len + routes_len;
+  in.nnodes = hdr.nnodes;
+  in.nhops = hdr.nhops;
+  in.ngroups = hdr.ngroups;
+  in.ngrouped = hdr.ngrouped;
+
+  if(hdr.nnodes && sr_fib_image_load_node(fib,&in,NULL,0,&(fib->root)) != 0)
+    goto bad;
+  if(fib->nnodes != hdr.nnodes || in.nhops || in.ngroups) goto bad;
+  if(engine == sr_fib_engine_dir24 && sr_fib_dir24_load(fib,&(in.pos),end) != 0)
+    goto bad;
+
+  *pos = in.pos;
+  *routes = in.routes;
+  return fib;
+
+bad:
+  sr_fib_destroy(fib);
+  return NULL;
+}
+/* ---< result cache >------------------------------------------------------- */
+/* --< constructor >--------------------------------------------------------- */
+struct sr_fib_cache *
+sr_fib_cache_create (void)
+{
+  struct sr_fib_cache * cache = calloc(1,sizeof(struct sr_fib_cache));
+  assert(cache);
+  return cache;
+}
+/* --< lookup >-------------------------------------------------------------- */
+int
+sr_fib_cache_lookup (struct sr_fib_cache * cache,
+  uint32_t gen,
+  uint32_t ip,
+  struct sr_rt ** route,
+  struct sr_if ** iface)
+{
+  struct sr_fib_cache_entry * entry = &(cache->entries[SR_FIB_CACHE_HASH(ip)]);
+  uint32_t seq = __atomic_load_n(&(entry->seq),__ATOMIC_ACQUIRE);
+
+  if(!(seq & 1) && entry->ip == ip && entry->gen == gen) {
+    *route = entry->route;
+    *iface = entry->iface;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&(entry->seq),__ATOMIC_RELAXED) == seq) {
+      cache->hits++;
+      return 1;
+    }
+  }
+
+  cache->misses++;
+  return 0;
+}
+/* --< fill >---------------------------------------------------------------- */
+void
+sr_fib_cache_fill (struct sr_fib_cache * cache,
+  uint32_t gen,
+  uint32_t ip,
+  struct sr_rt * route,
+  struct sr_if * iface)
+{
+  struct sr_fib_cache_entry * entry = &(cache->entries[SR_FIB_CACHE_HASH(ip)]);
+  uint32_t seq = __atomic_load_n(&(entry->seq),__ATOMIC_RELAXED);
+
+  if(seq & 1) return;
+  if(!__sync_bool_compare_and_swap(&(entry->seq),seq,seq + 1)) return;
+
+  entry->ip = ip;
+  entry->gen = gen;
+  entry->route = route;
+  entry->iface = iface;
+
+  __atomic_store_n(&(entry->seq),seq + 2,__ATOMIC_RELEASE);
+}
+/* --< stats >--------------------------------------------------------------- */
+void
+sr_fib_cache_print_stats (struct sr_fib_cache * cache)
+{
+  unsigned long total = cache->hits + cache->misses;
+
+  fprintf(stderr,"route cache: %d entries, %lu hits, %lu misses",
+      SR_FIB_CACHE_SZ,cache->hits,cache->misses);
+  if(total)
+    fprintf(stderr," (%.1f%% hit)",100.0 * cache->hits / total);
+  fprintf(stderr,"\n");
+}
@@ -0,0 +1,238 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.h
+ *
+ * Description:
+ *
+ * Compiled forwarding table. sr_load_rt compiles the sr_rt list into a
+ * path-compressed binary trie so that a longest prefix match costs at most
+ * one node per prefix bit instead of a walk over every route.
+ *
+ * The trie is always built. With the dir24 engine it is also expanded into
+ * DIR-24-8 tables: a 2^24 entry array indexed by the top 24 bits of the
+ * address, plus 256 entry groups for the /25 - /32 prefixes below those
+ * slots, so a lookup costs one or two memory accesses.
+ *
+ * Single routes can be added and withdrawn in place while other threads
+ * look up. New nodes and tables are fully built before they are linked
+ * in, and anything unlinked goes through sr_rcu_defer_free. Writers must
+ * hold sr->rt_lock. tbl8 groups emptied by withdrawals are only given back
+ * when the table is next rebuilt.
+ *
+ * A compiled fib can be written out with sr_fib_save and read back with
+ * sr_fib_load, which skips the trie build and dir24 expansion.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sr_rcu.h"
+#include "sr_rt.h"
+
+/* mask for the first len bits of a host byte order address, len 0 - 32 */
+#define SR_FIB_MASK(len) ((len) == 0 ? 0 : 0xffffffffU << (32 - (len)))
+/* bit number pos (0 is the most significant) of a host byte order address */
+#define SR_FIB_BIT(key,pos) (((key) >> (31 - (pos))) & 1)
+
+/* dir24 table entries: route index in the low 24 bits, the length of the
+   prefix that wrote the entry above it, and a flag marking tbl24 entries
+   that hold a tbl8 group number instead of a route index */
+#define SR_DIR24_EXT        0x80000000U
+#define SR_DIR24_IDX_MASK   0x00ffffffU
+#define SR_DIR24_DEPTH(e)   (((e) >> 24) & 0x3f)
+#define SR_DIR24_ENTRY(idx,depth) ((uint32_t)(idx) | ((uint32_t)(depth) << 24))
+#define SR_DIR24_TBL24_SZ   (1 << 24)
+#define SR_DIR24_TBL8_SZ    256
+
+/* lookups sr_fib_lookup_batch keeps in flight at once */
+#define SR_FIB_BATCH        16
+
+/* next hop result cache, direct mapped */
+#define SR_FIB_CACHE_BITS   13
+#define SR_FIB_CACHE_SZ     (1 << SR_FIB_CACHE_BITS)
+#define SR_FIB_CACHE_HASH(ip) \
+  (((uint32_t)(ip) * 2654435761U) >> (32 - SR_FIB_CACHE_BITS))
+
+enum sr_fib_engine {
+  sr_fib_engine_trie,
+  sr_fib_engine_dir24
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_node
+ *
+ * Node in the trie. Nodes with a NULL route only exist to join two subtrees
+ * whose prefixes diverge below the parent.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_node {
+  uint32_t prefix;               /* host byte order, bits past len are zero */
+  uint8_t len;                   /* prefix length, 0 - 32 */
+  uint8_t arena;                 /* in fib->arena, not freed on its own */
+  uint32_t idx;                  /* route index in the dir24 tables */
+  struct sr_rt * route;          /* route for prefix/len or NULL */
+  struct sr_fib_node * child[2]; /* indexed by bit number len of the key */
+};
+
+struct sr_fib {
+  enum sr_fib_engine engine;
+  uint32_t gen;                  /* changes whenever the routes change */
+  struct sr_fib_node * root;
+  unsigned int nroutes;          /* prefixes carrying a route */
+  unsigned int nnodes;           /* prefixes plus glue nodes */
+  void * arena;                  /* one block for the nodes, routes and
+                                    groups sr_fib_load made, or NULL */
+
+  /* dir24 engine only */
+  uint32_t * tbl24;
+  uint32_t * tbl8;
+  unsigned int ntbl8;            /* tbl8 groups in use */
+  unsigned int tbl8_cap;         /* tbl8 groups allocated */
+  struct sr_rt ** rtv;           /* route index -> route, 0 is no route */
+  unsigned int nrtv;
+  unsigned int rtv_cap;
+  uint32_t * idx_free;           /* withdrawn indexes, safe to reuse */
+  unsigned int nidx_free;
+  uint32_t * idx_pending;        /* withdrawn indexes, readers may hold */
+  unsigned int nidx_pending;
+  unsigned int idx_cap;          /* size of both index stacks */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_fib_cache
+ *
+ * Results of recent lookups, keyed by destination. An entry is only good
+ * for the fib generation it was filled from, so a new routing table makes
+ * every entry miss without touching the cache. seq is odd while an entry is
+ * being written; readers that see it change retry through the fib.
+ *
+ * It only pays where a lookup costs much more than a probe of the cache,
+ * as the trie's do, on traffic that returns to the same destinations; in
+ * front of dir24 it slows lookups down. The router uses it only with -C.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_fib_cache_entry {
+  uint32_t seq;
+  uint32_t ip;                   /* network byte order */
+  uint32_t gen;                  /* 0 never matches a fib */
+  struct sr_rt * route;          /* NULL caches a miss */
+  struct sr_if * iface;          /* egress interface of route */
+};
+
+struct sr_fib_cache {
+  struct sr_fib_cache_entry entries[SR_FIB_CACHE_SZ];
+  unsigned long hits;            /* not atomic, a guide for sizing only */
+  unsigned long misses;
+};
+
+/* Compiles the routes list into a new fib for the given engine. The fib
+   points into the list, so the list must outlive it. Routes for the same
+   prefix are gathered into an equal cost group led by the first of them.
+   Groups left on the list by an earlier build are freed and made again,
+   so any fib built from it before must be destroyed first. */
+struct sr_fib * sr_fib_build(struct sr_rt * routes, enum sr_fib_engine engine);
+
+/* Frees the trie and tables. The routes they point to are left alone,
+   except those sr_fib_load made, which go with the fib's arena; free the
+   list they are on first. */
+void sr_fib_destroy(struct sr_fib * fib);
+
+/* Adds route to a published fib. A route for a prefix already in the fib
+   replaces the old one, and any equal cost group it leads, which is
+   returned so the caller can retire it; otherwise returns NULL. Unlinked
+   memory is handed to rcu. */
+struct sr_rt * sr_fib_insert(struct sr_fib * fib, struct sr_rt * route,
+    struct sr_rcu * rcu);
+
+/* Adds route to a published fib as another next hop of the route already
+   there for its prefix, or as the first one if there is none. The group
+   it joins is replaced by a larger copy and the old one handed to rcu. */
+void sr_fib_append(struct sr_fib * fib, struct sr_rt * route,
+    struct sr_rcu * rcu);
+
+/* Withdraws the route for dest/mask from a published fib and returns it so
+   the caller can retire it, or returns NULL if there is none. */
+struct sr_rt * sr_fib_remove(struct sr_fib * fib, struct in_addr dest,
+    struct in_addr mask, struct sr_rcu * rcu);
+
+/* Call after the grace period that follows a batch of withdrawals, so the
+   route indexes they released can be reused. */
+void sr_fib_recycle(struct sr_fib * fib);
+
+/* Longest prefix match for ip, in network byte order. Returns NULL if no
+   route covers ip. */
+struct sr_rt * sr_fib_lookup(struct sr_fib * fib, uint32_t ip);
+
+/* Looks up n destinations (network byte order) at once, storing the route
+   for dsts[i] in results[i]. The lookups advance in lockstep, one trie
+   level or table access at a time, with the memory for the next step of
+   every lookup prefetched before any of them takes it, so the cache misses
+   of a burst overlap. */
+void sr_fib_lookup_batch(struct sr_fib * fib, const uint32_t * dsts,
+    unsigned int n, struct sr_rt ** results);
+
+/* Writes fib, and every route it leads to, to fp as a binary image that
+   sr_fib_load turns back into the same fib without compiling it again.
+   Returns 0 on success, -1 if a write fails. */
+int sr_fib_save(struct sr_fib * fib, FILE * fp);
+
+/* Rebuilds a fib for engine from the image sr_fib_save wrote at *pos, no
+   further than end, and moves *pos past it. routes is set to a new list of
+   the routes, sorted by prefix; the fib points into it as if sr_fib_build
+   had made it. The nodes, routes and groups are all carved from one arena
+   held by the fib, so loading allocates once and the table is freed at
+   once. Returns NULL if the image is for another engine, cut short or
+   inconsistent. */
+struct sr_fib * sr_fib_load(const unsigned char ** pos,
+    const unsigned char * end, enum sr_fib_engine engine,
+    struct sr_rt ** routes);
+
+/* Bytes allocated for lookups in fib: the trie, plus the tables of the
+   dir24 engine at their full size, whether or not every page of them has
+   been touched. The routes themselves are not counted. */
+size_t sr_fib_memory(struct sr_fib * fib);
+
+/* Number of leading one bits in a network byte order mask. */
+uint8_t sr_fib_mask_len(struct in_addr mask);
+
+/* Parses an engine name given on the command line. Returns 0 on success. */
+int sr_fib_parse_engine(const char * name, enum sr_fib_engine * engine);
+
+/* Allocates an empty result cache. */
+struct sr_fib_cache * sr_fib_cache_create(void);
+
+/* Looks ip up in the cache. gen is the fib generation read before the
+   lookup started. Returns 1 and sets route and iface if there is an entry
+   for ip filled under gen, 0 otherwise. */
+int sr_fib_cache_lookup(struct sr_fib_cache * cache, uint32_t gen,
+    uint32_t ip, struct sr_rt ** route, struct sr_if ** iface);
+
+/* Records the result of looking ip up in the fib under gen. Gives up
+   quietly if another thread is writing the same entry. */
+void sr_fib_cache_fill(struct sr_fib_cache * cache, uint32_t gen,
+    uint32_t ip, struct sr_rt * route, struct sr_if * iface);
+
+/* Prints the hit and miss counters. */
+void sr_fib_cache_print_stats(struct sr_fib_cache * cache);
+
+/* -- sr_fib_dir24.c -- */
+void sr_fib_dir24_build(struct sr_fib * fib);
+void sr_fib_dir24_destroy(struct sr_fib * fib);
+struct sr_rt * sr_fib_dir24_lookup(struct sr_fib * fib, uint32_t ip);
+void sr_fib_dir24_lookup_batch(struct sr_fib * fib, const uint32_t * dsts,
+    unsigned int n, struct sr_rt ** results);
+void sr_fib_dir24_insert(struct sr_fib * fib, struct sr_fib_node * node,
+    struct sr_rt * replaced, struct sr_rcu * rcu);
+void sr_fib_dir24_remove(struct sr_fib * fib, struct sr_fib_node * node,
+    struct sr_fib_node * cover);
+void sr_fib_dir24_recycle(struct sr_fib * fib);
+int sr_fib_dir24_save(struct sr_fib * fib, FILE * fp);
+int sr_fib_dir24_load(struct sr_fib * fib, const unsigned char ** pos,
+    const unsigned char * end);
+
+#endif /* -- SR_FIB_H -- */
@@ -0,0 +1,489 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_fib.h"
+
+/* What sr_fib_save adds for the dir24 engine, after the routes: this
+   header, tbl24 as runs of equal entries, then the tbl8 groups as they
+   are. Most of tbl24 repeats the entry of some short prefix or is empty,
+   so it shrinks to a few runs per route. */
+struct sr_fib_dir24_image_hdr {
+  uint32_t nrtv;
+  uint32_t ntbl8;
+  uint32_t nruns;
+};
+
+struct sr_fib_dir24_image_run {
+  uint32_t count;
+  uint32_t entry;
+};
+
+/* ---< private functions >-------------------------------------------------- */
+/* --< retire >-------------------------------------------------------------- */
+static void
+sr_fib_dir24_retire (struct sr_rcu * rcu, void * p)
+{
+  if(rcu)
+    sr_rcu_defer_free(rcu,p);
+  else
+    free(p);
+}
+/* --< tbl8 allocator >------------------------------------------------------ */
+/* Returns a new group filled with entry, the tbl24 entry it replaces. The
+   table grows into a fresh copy, since readers may be walking the old one. */
+static unsigned int
+sr_fib_dir24_new_tbl8 (struct sr_fib * fib, uint32_t entry, struct sr_rcu * rcu)
+{
+  unsigned int group;
+  unsigned int cap;
+  unsigned int i;
+  uint32_t * tbl8;
+
+  if(fib->ntbl8 == fib->tbl8_cap) {
+    cap = fib->tbl8_cap ? fib->tbl8_cap * 2 : 64;
+    assert(cap <= SR_DIR24_IDX_MASK);
+    tbl8 = malloc((size_t)cap * SR_DIR24_TBL8_SZ * sizeof(uint32_t));
+    assert(tbl8);
+    if(fib->tbl8)
+      memcpy(tbl8,fib->tbl8,
+          (size_t)fib->ntbl8 * SR_DIR24_TBL8_SZ * sizeof(uint32_t));
+    sr_fib_dir24_retire(rcu,fib->tbl8);
+    sr_rcu_assign_pointer(fib->tbl8,tbl8);
+    fib->tbl8_cap = cap;
+  }
+
+  group = fib->ntbl8++;
+  for(i = 0; i < SR_DIR24_TBL8_SZ; i++)
+    fib->tbl8[group * SR_DIR24_TBL8_SZ + i] = entry;
+  return group;
+}
+/* --< route index allocator >----------------------------------------------- */
+static uint32_t
+sr_fib_dir24_new_idx (struct sr_fib * fib, struct sr_rt * route,
+  struct sr_rcu * rcu)
+{
+  struct sr_rt ** rtv;
+  unsigned int cap;
+  uint32_t idx;
+
+  if(fib->nidx_free) {
+    idx = fib->idx_free[--fib->nidx_free];
+    sr_rcu_assign_pointer(fib->rtv[idx],route);
+    return idx;
+  }
+
+  if(fib->nrtv == fib->rtv_cap) {
+    cap = fib->rtv_cap * 2;
+    assert(cap <= SR_DIR24_IDX_MASK);
+    rtv = malloc(cap * sizeof(struct sr_rt *));
+    assert(rtv);
+    memcpy(rtv,fib->rtv,fib->nrtv * sizeof(struct sr_rt *));
+    sr_fib_dir24_retire(rcu,fib->rtv);
+    sr_rcu_assign_pointer(fib->rtv,rtv);
+    fib->rtv_cap = cap;
+  }
+
+  idx = fib->nrtv++;
+  sr_rcu_assign_pointer(fib->rtv[idx],route);
+  return idx;
+}
+/* --< fill range >---------------------------------------------------------- */
+/* Writes entry over every slot in [first,first+count) that was written by a
+   prefix no longer than depth. */
+static void
+sr_fib_dir24_fill (uint32_t * tbl,
+  unsigned int first,
+  unsigned int count,
+  uint32_t entry,
+  uint8_t depth)
+{
+  unsigned int i;
+  for(i = first; i < first + count; i++) {
+    if(SR_DIR24_DEPTH(tbl[i]) <= depth)
+      __atomic_store_n(&(tbl[i]),entry,__ATOMIC_RELEASE);
+  }
+}
+/* --< replace range >------------------------------------------------------- */
+/* Writes entry over every slot in [first,first+count) holding old. */
+static void
+sr_fib_dir24_replace (uint32_t * tbl,
+  unsigned int first,
+  unsigned int count,
+  uint32_t old,
+  uint32_t entry)
+{
+  unsigned int i;
+  for(i = first; i < first + count; i++) {
+    if(tbl[i] == old)
+      __atomic_store_n(&(tbl[i]),entry,__ATOMIC_RELEASE);
+  }
+}
+/* --< add prefix >---------------------------------------------------------- */
+static void
+sr_fib_dir24_add (struct sr_fib * fib,
+  uint32_t prefix,
+  uint8_t len,
+  uint32_t idx,
+  struct sr_rcu * rcu)
+{
+  uint32_t entry = SR_DIR24_ENTRY(idx,len);
+  unsigned int first = prefix >> 8;
+  unsigned int count;
+  unsigned int group;
+  unsigned int i;
+
+  if(len <= 24) {
+    count = 1U << (24 - len);
+    for(i = first; i < first + count; i++) {
+      if(fib->tbl24[i] & SR_DIR24_EXT) {
+        group = fib->tbl24[i] & SR_DIR24_IDX_MASK;
+        sr_fib_dir24_fill(fib->tbl8 + group * SR_DIR24_TBL8_SZ,
+            0,SR_DIR24_TBL8_SZ,entry,len);
+      } else if(SR_DIR24_DEPTH(fib->tbl24[i]) <= len) {
+        __atomic_store_n(&(fib->tbl24[i]),entry,__ATOMIC_RELEASE);
+      }
+    }
+    return;
+  }
+
+  if(fib->tbl24[first] & SR_DIR24_EXT) {
+    group = fib->tbl24[first] & SR_DIR24_IDX_MASK;
+  } else {
+    group = sr_fib_dir24_new_tbl8(fib,fib->tbl24[first],rcu);
+    /* the group and the table holding it are published before this */
+    __atomic_store_n(&(fib->tbl24[first]),SR_DIR24_EXT | group,
+        __ATOMIC_RELEASE);
+  }
+  sr_fib_dir24_fill(fib->tbl8 + group * SR_DIR24_TBL8_SZ,
+      prefix & 0xff,1U << (32 - len),entry,len);
+}
+/* --< expand trie >--------------------------------------------------------- */
+/* Preorder, so a prefix is always written before the ones it covers. */
+static void
+sr_fib_dir24_expand (struct sr_fib * fib, struct sr_fib_node * node)
+{
+  if(node == NULL) return;
+
+  if(node->route) {
+    node->idx = fib->nrtv++;
+    fib->rtv[node->idx] = node->route;
+    sr_fib_dir24_add(fib,node->prefix,node->len,node->idx,NULL);
+  }
+
+  sr_fib_dir24_expand(fib,node->child[0]);
+  sr_fib_dir24_expand(fib,node->child[1]);
+}
+/* --< image runs >---------------------------------------------------------- */
+/* Returns the number of runs tbl24 codes to, and writes them if fp is
+   set. Returns -1 if a write fails. */
+static long
+sr_fib_dir24_save_runs (const uint32_t * tbl24, FILE * fp)
+{
+  struct sr_fib_dir24_image_run run;
+  long nruns = 0;
+  uint32_t i = 0;
+
+  while(i < SR_DIR24_TBL24_SZ) {
+    run.entry = tbl24[i];
+    run.count = 0;
+    while(i < SR_DIR24_TBL24_SZ && tbl24[i] == run.entry) {
+      run.count++;
+      i++;
+    }
+    if(fp && fwrite(&run,sizeof(run),1,fp) != 1) return -1;
+    nruns++;
+  }
+  return nruns;
+}
+/* --< image route vector >-------------------------------------------------- */
+/* Points rtv back at the routes whose indexes the image gave their nodes.
+   Returns -1 if an index is out of range or taken twice. */
+static int
+sr_fib_dir24_load_rtv (struct sr_fib * fib, struct sr_fib_node * node)
+{
+  if(node == NULL) return 0;
+
+  if(node->route) {
+    if(node->idx == 0 || node->idx >= fib->nrtv || fib->rtv[node->idx])
+      return -1;
+    fib->rtv[node->idx] = node->route;
+  }
+
+  if(sr_fib_dir24_load_rtv(fib,node->child[0]) != 0) return -1;
+  return sr_fib_dir24_load_rtv(fib,node->child[1]);
+}
+/* --< image entry >--------------------------------------------------------- */
+/* A loaded entry may only name a route index, or tbl8 group, that exists. */
+static int
+sr_fib_dir24_entry_ok (struct sr_fib * fib, uint32_t entry, int tbl24)
+{
+  if(entry & SR_DIR24_EXT)
+    return tbl24 && (entry & SR_DIR24_IDX_MASK) < fib->ntbl8;
+  return (entry & SR_DIR24_IDX_MASK) < fib->nrtv;
+}
+/* ---< public functions >--------------------------------------------------- */
+/* --< constructor >--------------------------------------------------------- */
+void
+sr_fib_dir24_build (struct sr_fib * fib)
+{
+  assert(fib->nroutes < SR_DIR24_IDX_MASK);
+
+  /* calloc leaves untouched pages of the 64MB table unbacked */
+  fib->tbl24 = calloc(SR_DIR24_TBL24_SZ,sizeof(uint32_t));
+  assert(fib->tbl24);
+  fib->tbl8 = NULL;
+  fib->ntbl8 = 0;
+  fib->tbl8_cap = 0;
+
+  fib->rtv_cap = fib->nroutes + 64;
+  fib->rtv = malloc(fib->rtv_cap * sizeof(struct sr_rt *));
+  assert(fib->rtv);
+  fib->rtv[0] = NULL;
+  fib->nrtv = 1;
+
+  fib->idx_cap = 64;
+  fib->idx_free = malloc(fib->idx_cap * sizeof(uint32_t));
+  fib->idx_pending = malloc(fib->idx_cap * sizeof(uint32_t));
+  assert(fib->idx_free && fib->idx_pending);
+  fib->nidx_free = 0;
+  fib->nidx_pending = 0;
+
+  sr_fib_dir24_expand(fib,fib->root);
+}
+/* --< destructor >---------------------------------------------------------- */
+void
+sr_fib_dir24_destroy (struct sr_fib * fib)
+{
+  free(fib->tbl24);
+  free(fib->tbl8);
+  free(fib->rtv);
+  free(fib->idx_free);
+  free(fib->idx_pending);
+  fib->tbl24 = NULL;
+  fib->tbl8 = NULL;
+  fib->rtv = NULL;
+  fib->idx_free = NULL;
+  fib->idx_pending = NULL;
+}
+/* --< save >---------------------------------------------------------------- */
+int
+sr_fib_dir24_save (struct sr_fib * fib, FILE * fp)
+{
+  struct sr_fib_dir24_image_hdr hdr;
+  long nruns = sr_fib_dir24_save_runs(fib->tbl24,NULL);
+
+  hdr.nrtv = fib->nrtv;
+  hdr.ntbl8 = fib->ntbl8;
+  hdr.nruns = nruns;
+
+  if(fwrite(&hdr,sizeof(hdr),1,fp) != 1) return -1;
+  if(sr_fib_dir24_save_runs(fib->tbl24,fp) != nruns) return -1;
+  if(fib->ntbl8 && fwrite(fib->tbl8,(size_t)fib->ntbl8 * SR_DIR24_TBL8_SZ
+        * sizeof(uint32_t),1,fp) != 1)
+    return -1;
+  return 0;
+}
+/* --< load >---------------------------------------------------------------- */
+/* The trie is already loaded, with each node holding its saved index.
+   Anything allocated here is left for sr_fib_dir24_destroy on failure. */
+int
+sr_fib_dir24_load (struct sr_fib * fib,
+  const unsigned char ** pos,
+  const unsigned char * end)
+{
+  struct sr_fib_dir24_image_hdr hdr;
+  const struct sr_fib_dir24_image_run * runs;
+  size_t tbl8_len;
+  uint32_t first = 0;
+  uint32_t count;
+  size_t i;
+
+  if((size_t)(end - *pos) < sizeof(hdr)) return -1;
+  memcpy(&hdr,*pos,sizeof(hdr));
+  *pos += sizeof(hdr);
+  if(hdr.nrtv == 0 || hdr.nrtv > SR_DIR24_IDX_MASK
+      || hdr.ntbl8 > SR_DIR24_IDX_MASK
+      || hdr.nruns > (size_t)(end - *pos) / sizeof(*runs))
+    return -1;
+  runs = (const struct sr_fib_dir24_image_run *)*pos;
+  *pos += hdr.nruns * sizeof(*runs);
+  tbl8_len = (size_t)hdr.ntbl8 * SR_DIR24_TBL8_SZ * sizeof(uint32_t);
+  if((size_t)(end - *pos) < tbl8_len) return -1;
+
+  fib->nrtv = hdr.nrtv;
+  fib->rtv_cap = hdr.nrtv + 64;
+  fib->rtv = calloc(fib->rtv_cap,sizeof(struct sr_rt *));
+  assert(fib->rtv);
+  if(sr_fib_dir24_load_rtv(fib,fib->root) != 0) return -1;
+
+  fib->ntbl8 = hdr.ntbl8;
+  fib->tbl8_cap = hdr.ntbl8;
+  if(hdr.ntbl8) {
+    fib->tbl8 = malloc(tbl8_len);
+    assert(fib->tbl8);
+    memcpy(fib->tbl8,*pos,tbl8_len);
+    for(i = 0; i < (size_t)hdr.ntbl8 * SR_DIR24_TBL8_SZ; i++)
+      if(!sr_fib_dir24_entry_ok(fib,fib->tbl8[i],0)) return -1;
+  }
+  *pos += tbl8_len;
+
+  /* empty runs are skipped, leaving those pages of the table unbacked */
+  fib->tbl24 = calloc(SR_DIR24_TBL24_SZ,sizeof(uint32_t));
+  assert(fib->tbl24);
+  for(i = 0; i < hdr.nruns; i++) {
+    count = runs[i].count;
+    if(count > SR_DIR24_TBL24_SZ - first) return -1;
+    if(!sr_fib_dir24_entry_ok(fib,runs[i].entry,1)) return -1;
+    if(runs[i].entry == 0) {
+      first += count;
+      continue;
+    }
+    while(count--)
+      fib->tbl24[first++] = runs[i].entry;
+  }
+  if(first != SR_DIR24_TBL24_SZ) return -1;
+
+  /* indexes no route holds were withdrawn before the image was saved */
+  for(i = 1; i < fib->nrtv; i++)
+    if(fib->rtv[i] == NULL) fib->nidx_free++;
+  fib->idx_cap = fib->nidx_free + 64;
+  fib->idx_free = malloc(fib->idx_cap * sizeof(uint32_t));
+  fib->idx_pending = malloc(fib->idx_cap * sizeof(uint32_t));
+  assert(fib->idx_free && fib->idx_pending);
+  fib->nidx_free = 0;
+  for(i = fib->nrtv - 1; i > 0; i--)
+    if(fib->rtv[i] == NULL) fib->idx_free[fib->nidx_free++] = i;
+
+  return 0;
+}
+/* --< insert >-------------------------------------------------------------- */
+/* node carries the route just linked into the trie. If it displaced one,
+   the new route takes over its index and no table entry changes. */
+void
+sr_fib_dir24_insert (struct sr_fib * fib,
+  struct sr_fib_node * node,
+  struct sr_rt * replaced,
+  struct sr_rcu * rcu)
+{
+  if(replaced) {
+    sr_rcu_assign_pointer(fib->rtv[node->idx],node->route);
+    return;
+  }
+
+  node->idx = sr_fib_dir24_new_idx(fib,node->route,rcu);
+  sr_fib_dir24_add(fib,node->prefix,node->len,node->idx,rcu);
+}
+/* --< remove >-------------------------------------------------------------- */
+/* Hands every entry node wrote back to cover, the nearest shorter prefix
+   with a route, or to no route at all. */
+void
+sr_fib_dir24_remove (struct sr_fib * fib,
+  struct sr_fib_node * node,
+  struct sr_fib_node * cover)
+{
+  uint32_t old = SR_DIR24_ENTRY(node->idx,node->len);
+  uint32_t entry = cover ? SR_DIR24_ENTRY(cover->idx,cover->len) : 0;
+  unsigned int first = node->prefix >> 8;
+  unsigned int count;
+  unsigned int group;
+  unsigned int i;
+
+  if(node->len <= 24) {
+    count = 1U << (24 - node->len);
+    for(i = first; i < first + count; i++) {
+      if(fib->tbl24[i] & SR_DIR24_EXT) {
+        group = fib->tbl24[i] & SR_DIR24_IDX_MASK;
+        sr_fib_dir24_replace(fib->tbl8 + group * SR_DIR24_TBL8_SZ,
+            0,SR_DIR24_TBL8_SZ,old,entry);
+      } else if(fib->tbl24[i] == old) {
+        __atomic_store_n(&(fib->tbl24[i]),entry,__ATOMIC_RELEASE);
+      }
+    }
+  } else {
+    group = fib->tbl24[first] & SR_DIR24_IDX_MASK;
+    sr_fib_dir24_replace(fib->tbl8 + group * SR_DIR24_TBL8_SZ,
+        node->prefix & 0xff,1U << (32 - node->len),old,entry);
+  }
+
+  /* readers may still hold entries naming this index; both stacks end up
+     in idx_free, so they share the room */
+  if(fib->nidx_free + fib->nidx_pending == fib->idx_cap) {
+    fib->idx_cap *= 2;
+    fib->idx_free = realloc(fib->idx_free,fib->idx_cap * sizeof(uint32_t));
+    fib->idx_pending = realloc(fib->idx_pending,fib->idx_cap * sizeof(uint32_t));
+    assert(fib->idx_free && fib->idx_pending);
+  }
+  fib->idx_pending[fib->nidx_pending++] = node->idx;
+}
+/* --< recycle >------------------------------------------------------------- */
+void
+sr_fib_dir24_recycle (struct sr_fib * fib)
+{
+  while(fib->nidx_pending)
+    fib->idx_free[fib->nidx_free++] = fib->idx_pending[--fib->nidx_pending];
+}
+/* --< batch lookup >-------------------------------------------------------- */
+/* Each group of lookups prefetches its tbl24 entries, then the tbl8 slots
+   some of them lead to, before finishing any. The route vector is small
+   enough to stay cached and isn't prefetched. As in sr_fib_dir24_lookup,
+   tbl8 is read after the tbl24 entries that index it, and rtv after the
+   entries that index it, so a table grown in between is always seen. */
+void
+sr_fib_dir24_lookup_batch (struct sr_fib * fib,
+  const uint32_t * dsts,
+  unsigned int n,
+  struct sr_rt ** results)
+{
+  uint32_t entry[SR_FIB_BATCH];
+  uint32_t key[SR_FIB_BATCH];
+  uint32_t * tbl8;
+  struct sr_rt ** rtv;
+  unsigned int base, count, i;
+
+  for(base = 0; base < n; base += count) {
+    count = n - base < SR_FIB_BATCH ? n - base : SR_FIB_BATCH;
+
+    for(i = 0; i < count; i++) {
+      key[i] = ntohl(dsts[base + i]);
+      __builtin_prefetch(&(fib->tbl24[key[i] >> 8]));
+    }
+
+    for(i = 0; i < count; i++)
+      entry[i] = __atomic_load_n(&(fib->tbl24[key[i] >> 8]),__ATOMIC_ACQUIRE);
+
+    tbl8 = sr_rcu_dereference(fib->tbl8);
+    for(i = 0; i < count; i++) {
+      if(entry[i] & SR_DIR24_EXT)
+        __builtin_prefetch(&(tbl8[(entry[i] & SR_DIR24_IDX_MASK)
+              * SR_DIR24_TBL8_SZ + (key[i] & 0xff)]));
+    }
+
+    for(i = 0; i < count; i++) {
+      if(entry[i] & SR_DIR24_EXT)
+        entry[i] = __atomic_load_n(&(tbl8[(entry[i] & SR_DIR24_IDX_MASK)
+              * SR_DIR24_TBL8_SZ + (key[i] & 0xff)]),__ATOMIC_ACQUIRE);
+    }
+
+    rtv = sr_rcu_dereference(fib->rtv);
+    for(i = 0; i < count; i++)
+      results[base + i] = rtv[entry[i] & SR_DIR24_IDX_MASK];
+  }
+}
+/* --< lookup >-------------------------------------------------------------- */
+struct sr_rt *
+sr_fib_dir24_lookup (struct sr_fib * fib, uint32_t ip)
+{
+  uint32_t key = ntohl(ip);
+  uint32_t entry = __atomic_load_n(&(fib->tbl24[key >> 8]),__ATOMIC_ACQUIRE);
+  uint32_t * tbl8;
+
+  if(entry & SR_DIR24_EXT) {
+    tbl8 = sr_rcu_dereference(fib->tbl8);
+    entry = __atomic_load_n(&(tbl8[(entry & SR_DIR24_IDX_MASK)
+          * SR_DIR24_TBL8_SZ + (key & 0xff)]),__ATOMIC_ACQUIRE);
+  }
+
+  return sr_rcu_dereference(fib->rtv)[entry & SR_DIR24_IDX_MASK];
+}
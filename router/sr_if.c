@@ -65,6 +65,7 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name)
 void sr_add_interface(struct sr_instance* sr, const char* name)
 {
     struct sr_if* if_walker = 0;
+    unsigned int index = 1;
 
     /* -- REQUIRES -- */
     assert(name);
@@ -76,6 +77,8 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
         sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
         assert(sr->if_list);
         sr->if_list->next = 0;
+        sr->if_list->index = 0;
+        sr->if_list->vrf = 0;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
         return;
     }
@@ -83,13 +86,15 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     /* -- find the end of the list -- */
     if_walker = sr->if_list;
     while(if_walker->next)
-    {if_walker = if_walker->next; }
+    {if_walker = if_walker->next; index++; }
 
     if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
     assert(if_walker->next);
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
     if_walker->next = 0;
+    if_walker->index = index;
+    if_walker->vrf = 0;
 } /* -- sr_add_interface -- */ 
 
 /*--------------------------------------------------------------------- 
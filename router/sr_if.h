@@ -41,6 +41,8 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  unsigned int index; /* position in the interface list */
+  unsigned int vrf; /* routing table for packets received here */
   struct sr_if* next;
 };
 
@@ -30,6 +30,7 @@
 #include <getopt.h>
 #endif /* _LINUX_ */
 
+#include "sr_ctl.h"
 #include "sr_dumper.h"
 #include "sr_nat.h"
 #include "sr_router.h"
@@ -67,13 +68,23 @@ int main(int argc, char **argv)
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    char *ctl_path = 0;
+    char *rt_image = 0;
+    char *neighbors = 0;
+    long arp_size = SR_ARPCACHE_SZ;
+    enum sr_arpq_policy arp_policy = sr_arpq_drop_oldest;
     bool enable_nat = false;
+    bool rt_cached = false;
+    long nat_icmp_to = SR_NAT_ICMP_TO;
+    long nat_tcp_est_to = SR_NAT_TCP_EST_TO;
+    long nat_tcp_trans_to = SR_NAT_TCP_TRANS_TO;
+    enum sr_fib_engine fib_engine = sr_fib_engine_trie;
     struct sr_instance sr;
     struct sr_nat * nat = NULL;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hns:v:p:u:t:r:l:T:")) != EOF)
+    while ((c = getopt(argc, argv, "hnCs:v:p:u:t:r:l:T:f:c:F:a:q:N:I:E:R:")) != EOF)
     {
         switch (c)
         {
@@ -84,6 +95,9 @@ int main(int argc, char **argv)
             case 'n':
                 enable_nat = true; 
                 break;
+            case 'C':
+                rt_cached = true;
+                break;
             case 'p':
                 port = atoi((char *) optarg);
                 break;
@@ -108,11 +122,72 @@ int main(int argc, char **argv)
             case 'T':
                 template = optarg;
                 break;
+            case 'c':
+                ctl_path = optarg;
+                break;
+            case 'F':
+                rt_image = optarg;
+                break;
+            case 'N':
+                neighbors = optarg;
+                break;
+            case 'a':
+                arp_size = atol((char *) optarg);
+                if(arp_size <= 0 || arp_size > SR_ARPCACHE_MAX)
+                {
+                    fprintf(stderr,"ARP cache size must be 1 to %d\n",
+                            SR_ARPCACHE_MAX);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'q':
+                if(strcmp(optarg, "oldest") == 0)
+                { arp_policy = sr_arpq_drop_oldest; }
+                else if(strcmp(optarg, "newest") == 0)
+                { arp_policy = sr_arpq_drop_newest; }
+                else
+                {
+                    fprintf(stderr,"Unknown queue policy %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'I':
+            case 'E':
+            case 'R':
+                if(atol((char *) optarg) <= 0)
+                {
+                    fprintf(stderr,"NAT timeouts must be positive\n");
+                    usage(argv[0]);
+                    exit(1);
+                }
+                if(c == 'I')
+                { nat_icmp_to = atol((char *) optarg); }
+                else if(c == 'E')
+                { nat_tcp_est_to = atol((char *) optarg); }
+                else
+                { nat_tcp_trans_to = atol((char *) optarg); }
+                break;
+            case 'f':
+                if(sr_fib_parse_engine(optarg, &fib_engine) != 0)
+                {
+                    fprintf(stderr,"Unknown lookup engine %s\n", optarg);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
         } /* switch */
     } /* -- while -- */
 
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
+    sr.fib_engine = fib_engine;
+    sr.rt_cached = rt_cached;
+    sr.rt_image = rt_image;
+    sr.arp_size = arp_size;
+    sr.arp_policy = arp_policy;
+    sr.neighbors = neighbors;
 
     /* -- set up routing table from file -- */
     if(template == NULL) {
@@ -165,12 +240,20 @@ int main(int argc, char **argv)
 
     /* call router init (for arp subsystem etc.) */
     sr_init(&sr);
+    if(ctl_path && sr_ctl_start(&sr, ctl_path) != 0)
+    {
+        fprintf(stderr,"Error opening control socket %s\n", ctl_path);
+        exit(1);
+    }
     if(enable_nat) {
       nat = malloc(sizeof(struct sr_nat));
       if(nat == NULL) {
         perror("failed to initialize nat");
       } else {
         sr_nat_init(&sr,nat);
+        nat->icmp_to = nat_icmp_to;
+        nat->tcp_est_to = nat_tcp_est_to;
+        nat->tcp_trans_to = nat_tcp_trans_to;
       }
       sr.nat = nat;
     }
@@ -194,9 +277,21 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
-    printf("   defaults server=%s port=%d host=%s  \n",
-            DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
+    printf("           [-l log file] [-f trie|dir24] [-C] \n");
+    printf("           [-c control socket] [-F routing table image] \n");
+    printf("           [-a arp cache entries] [-q oldest|newest] \n");
+    printf("           [-N static neighbors] [-n] \n");
+    printf("           [-I icmp timeout] [-E tcp established timeout] \n");
+    printf("           [-R tcp transitory timeout] \n");
+    printf("   -C caches route lookups per destination, which pays off with\n");
+    printf("      -f trie on traffic to few destinations (see make bench)\n");
+    printf("   -q picks the packet dropped when arp queues are full\n");
+    printf("   -n enables the nat, whose idle timeouts -I, -E and -R set in seconds\n");
+    printf("   send SIGHUP to reload the routing table\n");
+    printf("   defaults server=%s port=%d host=%s arp cache=%d \n",
+            DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST, SR_ARPCACHE_SZ );
+    printf("            icmp=%d established=%d transitory=%d \n",
+            SR_NAT_ICMP_TO, SR_NAT_TCP_EST_TO, SR_NAT_TCP_TRANS_TO );
 } /* -- usage -- */
 
 /*-----------------------------------------------------------------------------
@@ -241,6 +336,11 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    if(sr->rt_cache)
+    {
+        sr_fib_cache_print_stats(sr->rt_cache);
+    }
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -263,7 +363,19 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
-    sr->routing_table = 0;
+    memset(sr->vrf, 0, sizeof(sr->vrf));
+    sr->vrf_binds = 0;
+    sr_rcu_init(&(sr->rcu));
+    pthread_mutex_init(&(sr->rt_lock), NULL);
+    sr->rtable = 0;
+    sr->rt_image = 0;
+    sr->fib_engine = sr_fib_engine_trie;
+    sr->rt_cached = 0;
+    sr->rt_cache = 0;
+    sr->adj_list = 0;
+    sr->arp_size = SR_ARPCACHE_SZ;
+    sr->arp_policy = sr_arpq_drop_oldest;
+    sr->neighbors = 0;
     sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
@@ -271,8 +383,8 @@ static void sr_init_instance(struct sr_instance* sr)
  * Method: sr_verify_routing_table()
  * Scope: Global
  *
- * make sure the routing table is consistent with the interface list by
- * verifying that all interfaces used in the routing table actually exist
+ * make sure the routing tables are consistent with the interface list by
+ * verifying that all interfaces used in the routing tables actually exist
  * in the hardware.
  *
  * RETURN VALUES:
@@ -286,34 +398,50 @@ int sr_verify_routing_table(struct sr_instance* sr)
 {
     struct sr_rt* rt_walker = 0;
     struct sr_if* if_walker = 0;
+    unsigned int i;
+    int empty = 1;
     int ret = 0;
 
     /* -- REQUIRES --*/
     assert(sr);
 
-    if( (sr->if_list == 0) || (sr->routing_table == 0))
+    pthread_mutex_lock(&(sr->rt_lock));
+
+    for(i = 0; i < SR_VRF_MAX; i++)
     {
-        return 999; /* doh! */
+        if(sr->vrf[i].routing_table)
+        { empty = 0; }
     }
 
-    rt_walker = sr->routing_table;
+    if( (sr->if_list == 0) || empty)
+    {
+        pthread_mutex_unlock(&(sr->rt_lock));
+        return 999; /* doh! */
+    }
 
-    while(rt_walker)
+    for(i = 0; i < SR_VRF_MAX; i++)
     {
-        /* -- check to see if interface exists -- */
-        if_walker = sr->if_list;
-        while(if_walker)
-        {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
-                    == 0)
-            { break; }
-            if_walker = if_walker->next;
-        }
-        if(if_walker == 0)
-        { ret++; } /* -- interface not found! -- */
+        rt_walker = sr->vrf[i].routing_table;
 
-        rt_walker = rt_walker->next;
-    } /* -- while -- */
+        while(rt_walker)
+        {
+            /* -- check to see if interface exists -- */
+            if_walker = sr->if_list;
+            while(if_walker)
+            {
+                if( strncmp(if_walker->name,rt_walker->interface,
+                            sr_IFACE_NAMELEN) == 0)
+                { break; }
+                if_walker = if_walker->next;
+            }
+            if(if_walker == 0)
+            { ret++; } /* -- interface not found! -- */
+
+            rt_walker = rt_walker->next;
+        } /* -- while -- */
+    } /* -- for -- */
+
+    pthread_mutex_unlock(&(sr->rt_lock));
 
     return ret;
 } /* -- sr_verify_routing_table -- */
@@ -324,7 +452,7 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
                 rtable);
         exit(1);
     }
-
+    sr->rtable = rtable;
 
     printf("Loading routing table\n");
     printf("---------------------------------------------\n");
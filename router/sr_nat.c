@@ -6,6 +6,7 @@
 #include "sr_nat.h"
 #include "sr_protocol.h"
 #include "sr_utils.h"
+#include "sr_utils_nat.h"
 
 /* ---< private functions >-------------------------------------------------- */
 /* --< is unsolicited syn >-------------------------------------------------- */
@@ -31,6 +32,12 @@ sr_get_nat_ip_internal(struct sr_instance * sr)
   struct sr_if * iface = sr_get_interface(sr,NAT_INTERNAL_IF);
   return iface->ip;
 }
+static uint32_t
+sr_get_nat_ip_external(struct sr_instance * sr)
+{
+  struct sr_if * iface = sr_get_interface(sr,NAT_EXTERNAL_IF);
+  return iface->ip;
+}
 /* --< aux helpers >--------------------------------------------------------- */
 /* -< icmp aux allocator >--------------------------------------------------- */
 static uint16_t
@@ -38,6 +45,39 @@ sr_nat_assign_icmp_aux_int (uint8_t * packet)
 {
   return sr_get_icmp8_id(packet);
 }
+/* -< has l4 header >-------------------------------------------------------- */
+/* Whether the L4 header sits where the TCP_HDR family of macros reads it.
+   Fragments after the first carry no L4 header, only payload, and with IP
+   options the header starts past them; neither can be looked up nor
+   rewritten by port. */
+static bool
+sr_nat_has_l4_header (uint8_t * packet)
+{
+  if(sr_get_ip_hl(packet) != IP_HDR_LEN / 4)
+    return false;
+  return (ntohs(sr_get_ip_off(packet)) & IP_OFFMASK) == 0;
+}
+/* -< has aux_int >---------------------------------------------------------- */
+/* Whether an outgoing packet carries a port or echo id to be mapped by.
+   ICMP other than echo requests has none, nor does a truncated segment,
+   a later fragment or a packet with IP options. */
+static bool
+sr_nat_has_aux_int (uint8_t * packet,
+  unsigned int len,
+  sr_nat_mapping_type ip_p)
+{
+  if(!sr_nat_has_l4_header(packet)) {
+    return false;
+  }
+  if(ip_p == nat_mapping_icmp) {
+    return !sr_validate_icmp(packet,len)
+      && sr_get_icmp_type(packet) == ICMP_ECHO_REQUEST;
+  }
+  if(ip_p == nat_mapping_tcp) {
+    return !sr_validate_tcp(packet,len);
+  }
+  return !sr_validate_udp(packet,len);
+}
 /* -< get aux_int >---------------------------------------------------------- */
 static uint16_t
 sr_nat_get_aux_int (uint8_t * packet,
@@ -116,18 +156,6 @@ sr_nat_get_mapping_type (uint8_t * packet)
   return nat_mapping_unknown;
 }
 /* ---< cache helpers >------------------------------------------------------ */
-/* --< get cache entry type >------------------------------------------------ */
-static sr_nat_cache_entry_type
-sr_nat_get_cache_entry_type (struct sr_nat_mapping * cache_entry)
-{
-  if (cache_entry == NULL) {
-    return cache_entry_miss;
-  }
-  if (!(cache_entry->ip_int && cache_entry->aux_int)) {
-    return cache_entry_partial_hit;
-  }
-  return cache_entry_complete_hit;
-}
 /* --< handle cache miss >--------------------------------------------------- */
 static void
 sr_nat_handle_cache_miss(struct sr_instance * sr,
@@ -160,16 +188,88 @@ sr_nat_handle_cache_partial_hit(struct sr_instance * sr,
     return;
 }
 /* ---< rewrite routines >--------------------------------------------------- */
+/* Checksums are adjusted for the fields rewritten rather than recomputed,
+   so translating a packet costs the same whatever its payload. TCP and UDP
+   sums also cover the addresses, through the pseudo header; an ICMP sum
+   only covers the echo id. */
+/* --< l4 rewrite >---------------------------------------------------------- */
+static void
+sr_nat_rewrite_l4 (uint8_t * packet,
+  sr_nat_mapping_type type,
+  bool src,
+  uint32_t ip_old,
+  uint32_t ip_new,
+  uint16_t aux_new)
+{
+  uint16_t aux_old, sum;
+
+  if(type == nat_mapping_tcp) {
+    aux_old = src ? sr_get_tcp_src(packet) : sr_get_tcp_dst(packet);
+    if(src)
+      sr_set_tcp_src(packet,aux_new);
+    else
+      sr_set_tcp_dst(packet,aux_new);
+    sum = sr_sum_adjust32(sr_get_tcp_sum(packet),ip_old,ip_new);
+    sr_set_tcp_sum(packet,sr_sum_adjust16(sum,aux_old,aux_new));
+    return;
+  }
+
+  if(type == nat_mapping_udp) {
+    aux_old = src ? sr_get_udp_src(packet) : sr_get_udp_dst(packet);
+    if(src)
+      sr_set_udp_src(packet,aux_new);
+    else
+      sr_set_udp_dst(packet,aux_new);
+    /* -- 0 is no checksum, and one that comes to 0 is sent as ~0 -- */
+    if(sr_get_udp_sum(packet) == 0) return;
+    sum = sr_sum_adjust32(sr_get_udp_sum(packet),ip_old,ip_new);
+    sum = sr_sum_adjust16(sum,aux_old,aux_new);
+    sr_set_udp_sum(packet,sum ? sum : 0xffff);
+    return;
+  }
+
+  if(type == nat_mapping_icmp) {
+    if(src && sr_get_icmp_type(packet) == ICMP_ECHO_REQUEST) {
+      aux_old = sr_get_icmp8_id(packet);
+      sr_set_icmp8_id(packet,aux_new);
+    } else if(!src && sr_get_icmp_type(packet) == ICMP_ECHO_REPLY) {
+      aux_old = sr_get_icmp0_id(packet);
+      sr_set_icmp0_id(packet,aux_new);
+    } else {
+      return;
+    }
+    sr_set_icmp_sum(packet,
+        sr_sum_adjust16(sr_get_icmp_sum(packet),aux_old,aux_new));
+  }
+}
+/* --< address rewrite >----------------------------------------------------- */
+/* Outgoing packets with nothing to map by only have their source address
+   translated, which takes no mapping. */
+static void
+sr_nat_rewrite_address (struct sr_instance * sr,
+  uint8_t * packet)
+{
+  uint32_t ip_src = sr_get_ip_src(packet);
+  uint32_t ip_ext = sr_get_nat_ip_external(sr);
+
+  sr_set_ip_src(packet,ip_ext);
+  sr_set_ip_sum(packet,
+      sr_sum_adjust32(sr_get_ip_sum(packet),ip_src,ip_ext));
+}
 /* --< internal rewrite >---------------------------------------------------- */
 static void
 sr_nat_rewrite_internal (struct sr_instance * sr,
   uint8_t * packet,
   unsigned int len,
-  struct sr_nat_mapping * natcache_entry)
+  const struct sr_nat_xlate * xlate)
 {
-  sr_set_ip_src(packet,natcache_entry->ip_ext);
-  /* TODO : tcp + udp */
-  sr_compute_set_ip_sum(packet);
+  uint32_t ip_src = sr_get_ip_src(packet);
+
+  sr_set_ip_src(packet,xlate->ip_ext);
+  sr_set_ip_sum(packet,
+      sr_sum_adjust32(sr_get_ip_sum(packet),ip_src,xlate->ip_ext));
+  sr_nat_rewrite_l4(packet,xlate->type,true,ip_src,
+      xlate->ip_ext,xlate->aux_ext);
   return;
 }
 /* --< external rewrite >---------------------------------------------------- */
@@ -177,81 +277,82 @@ static void
 sr_nat_rewrite_external (struct sr_instance * sr,
   uint8_t * packet,
   unsigned int len,
-  struct sr_nat_mapping * natcache_entry)
+  const struct sr_nat_xlate * xlate)
 {
-  sr_set_ip_dst(packet,natcache_entry->ip_int);
-  /* TODO tcp + udp */
-  sr_compute_set_ip_sum(packet);
+  uint32_t ip_dst = sr_get_ip_dst(packet);
+
+  sr_set_ip_dst(packet,xlate->ip_int);
+  sr_set_ip_sum(packet,
+      sr_sum_adjust32(sr_get_ip_sum(packet),ip_dst,xlate->ip_int));
+  sr_nat_rewrite_l4(packet,xlate->type,false,ip_dst,
+      xlate->ip_int,xlate->aux_int);
   return;
 }
 /* ---< translation routines >----------------------------------------------- */
 /* --< internal translation >------------------------------------------------ */
-static void
+static int
 sr_nat_translate_internal (struct sr_instance * sr,
   uint8_t * packet,
   unsigned int len)
 {
-  if(sr_get_ip_dst(packet) == sr_get_nat_ip_internal(sr)) return;
+  if(sr_get_ip_dst(packet) == sr_get_nat_ip_internal(sr)) return 0;
 
   sr_nat_mapping_type mapping_type = sr_nat_get_mapping_type(packet);
-  if(mapping_type == nat_mapping_unknown) return;
+  if(mapping_type == nat_mapping_unknown) return 0;
+  if(!sr_nat_has_aux_int(packet,len,mapping_type)) {
+    sr_nat_rewrite_address(sr,packet);
+    return 0;
+  }
   uint16_t aux_int = sr_nat_get_aux_int(packet,len,mapping_type);
 
-  struct sr_nat_mapping * natcache_entry;
-  natcache_entry = sr_nat_lookup_internal(sr->nat,sr_get_ip_src(packet),
-      aux_int, mapping_type);
-  sr_nat_cache_entry_type entry_type;
-  entry_type = sr_nat_get_cache_entry_type(natcache_entry);
-
-  if(entry_type == cache_entry_miss) {
-    natcache_entry = sr_nat_insert_mapping(sr,sr_get_ip_src(packet),
-        aux_int,mapping_type);
-  }
-  if(entry_type == cache_entry_partial_hit) {
-    sr_nat_remove_entry(sr->nat, natcache_entry);
+  struct sr_nat_xlate xlate;
+  if(sr_nat_lookup_internal(sr->nat,sr_get_ip_src(packet),aux_int,
+        mapping_type,packet,&xlate) == cache_entry_miss
+      && sr_nat_insert_mapping(sr,sr_get_ip_src(packet),aux_int,
+        mapping_type,packet,&xlate) < 0) {
+    return -1;
   }
 
-  assert(natcache_entry);
-  sr_nat_rewrite_internal(sr,packet,len,natcache_entry);
-  free(natcache_entry);
+  sr_nat_rewrite_internal(sr,packet,len,&xlate);
+  return 0;
 }
 /* --< external translation >------------------------------------------------ */
-static void
+static int
 sr_nat_translate_external (struct sr_instance * sr,
   uint8_t * packet,
   unsigned int len)
 {
   sr_nat_mapping_type mapping_type = sr_nat_get_mapping_type(packet);
-  if(mapping_type == nat_mapping_unknown) return;
+  if(mapping_type == nat_mapping_unknown) return 0;
+  /* -- with no port to find its mapping by, it is left as it came -- */
+  if(!sr_nat_has_l4_header(packet)) return 0;
   uint16_t aux_ext = sr_nat_get_aux_ext(packet,len,mapping_type);
 
   /* FIXME -- */
-  if((mapping_type == nat_mapping_tcp) && (ntohs(aux_ext) < 1025)) {
-    return;
+  if((mapping_type == nat_mapping_tcp) && (ntohs(aux_ext) < SR_NAT_PORT_MIN)) {
+    return 0;
   }
   /* -- FIXME */
 
-  struct sr_nat_mapping * natcache_entry;
-  natcache_entry = sr_nat_lookup_external(sr->nat,aux_ext,mapping_type);
+  struct sr_nat_xlate xlate;
   sr_nat_cache_entry_type entry_type;
-  entry_type = sr_nat_get_cache_entry_type(natcache_entry);
+  entry_type = sr_nat_lookup_external(sr->nat,aux_ext,mapping_type,packet,
+      &xlate);
 
   if(entry_type == cache_entry_miss) {
     sr_nat_handle_cache_miss(sr,packet,aux_ext,len,mapping_type);
-    return;
+    return 0;
   }
   if (entry_type == cache_entry_partial_hit) {
     sr_nat_handle_cache_partial_hit(sr,packet,aux_ext,len,mapping_type);
-    return;
+    return 0;
   }
 
-  assert(natcache_entry);
-  sr_nat_rewrite_external(sr,packet,len,natcache_entry);
-  free(natcache_entry);
-  return  ;
+  sr_nat_rewrite_external(sr,packet,len,&xlate);
+  return 0;
 }
 /* ---< public nat interface >----------------------------------------------- */
-void
+int
 sr_nat (struct sr_instance * sr,
   uint8_t * packet,
   unsigned int len,
@@ -261,63 +362,105 @@ sr_nat (struct sr_instance * sr,
   assert(sr->nat);
   assert(packet);
 
-  if(sr_nat_is_ip_packet(packet,len) == false) return;
+  if(sr_nat_is_ip_packet(packet,len) == false) return 0;
 
   if(strcmp(interface,NAT_INTERNAL_IF) == 0) {
-    sr_nat_translate_internal(sr,packet,len);
-    return;
+    return sr_nat_translate_internal(sr,packet,len);
   }
 
   if(strcmp(interface,NAT_EXTERNAL_IF) == 0) {
-    sr_nat_translate_external(sr,packet,len);
-    return;
+    return sr_nat_translate_external(sr,packet,len);
   }
 
-  return;
+  return 0;
 }
 /* --< constructor >--------------------------------------------------------- */
+static int
+sr_nat_init_shard (struct sr_nat * nat, struct sr_nat_shard * shard,
+  unsigned int index)
+{
+  int i;
+
+  shard->nat = nat;
+  shard->mappings = NULL;
+  shard->count = 0;
+  for(i = 0; i < nat_mapping_unknown; i++)
+    sr_nat_init_ports(&(shard->ports[i]),index);
+  sr_timer_wheel_init(&(shard->wheel));
+  shard->int_index = calloc(SR_NAT_BUCKETS,sizeof(struct sr_nat_mapping *));
+  shard->ext_index = calloc(SR_NAT_BUCKETS,sizeof(struct sr_nat_mapping *));
+  if(shard->int_index == NULL || shard->ext_index == NULL) {
+    free(shard->int_index);
+    free(shard->ext_index);
+    return -1;
+  }
+  return pthread_mutex_init(&(shard->lock), &(nat->attr));
+}
+
 int
 sr_nat_init (struct sr_instance * sr, struct sr_nat * nat) 
 {
   assert(nat);
+  int i;
 
   pthread_mutexattr_init(&(nat->attr));
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+
+  /* The timeout thread runs the shards' wheels from its first tick */
+  nat->sr = sr;
+  for(i = 0; i < SR_NAT_SHARDS; i++) {
+    if(sr_nat_init_shard(nat,&(nat->shards[i]),i) != 0)
+      return -1;
+  }
 
   /* Initialize timeout thread */
 
   pthread_attr_init(&(nat->thread_attr));
   pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
   pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_create(&(nat->thread), &(nat->thread_attr), sr_natcache_timeout, sr);
+  pthread_create(&(nat->thread), &(nat->thread_attr), sr_natcache_timeout, nat);
 
   /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
-  nat->mappings = NULL;
   /* Initialize any variables here */
+  nat->icmp_to = SR_NAT_ICMP_TO;
+  nat->tcp_est_to = SR_NAT_TCP_EST_TO;
+  nat->tcp_trans_to = SR_NAT_TCP_TRANS_TO;
 
-  return success;
+  return 0;
 }
 /* --< destructor >---------------------------------------------------------- */
 int
 sr_nat_destroy (struct sr_nat * nat) {
 
-  pthread_mutex_lock(&(nat->lock));
-
-  struct sr_nat_mapping * map_it = nat->mappings;
+  struct sr_nat_mapping * map_it;
   struct sr_nat_mapping * temp = NULL;
+  struct sr_nat_connection * conn;
+  int i, failed = 0;
+
+  for(i = 0; i < SR_NAT_SHARDS; i++) {
+    pthread_mutex_lock(&(nat->shards[i].lock));
+
+    map_it = nat->shards[i].mappings;
+    while(map_it != NULL) {
+      temp = map_it->next;
+      while(map_it->conns != NULL) {
+        conn = map_it->conns;
+        map_it->conns = conn->next;
+        free(conn->packet);
+        free(conn);
+      }
+      free(map_it);
+      map_it = temp;
+    }
+    nat->shards[i].mappings = NULL;
+    free(nat->shards[i].int_index);
+    free(nat->shards[i].ext_index);
 
-  while(map_it != NULL) {
-    temp = map_it->next;
-    free(map_it);
-    map_it = temp;
+    pthread_mutex_unlock(&(nat->shards[i].lock));
+    failed |= pthread_mutex_destroy(&(nat->shards[i].lock));
   }
 
-  pthread_mutex_unlock(&(nat->lock));
-
   pthread_kill(nat->thread, SIGKILL);
-  return pthread_mutex_destroy(&(nat->lock)) &&
-    pthread_mutexattr_destroy(&(nat->attr));
-
+  return failed || pthread_mutexattr_destroy(&(nat->attr));
 }
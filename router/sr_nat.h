@@ -6,8 +6,21 @@
 #include <stdint.h>
 
 #include "sr_rt.h"
-
-#define SR_NAT_TO 5
+#include "sr_timer.h"
+
+/* Idle timeouts, in seconds. ICMP and the TCP ones can be set with -I,
+   -E and -R. A connection is transitory while being opened or closed. */
+#define SR_NAT_ICMP_TO      60
+#define SR_NAT_TCP_EST_TO   7440
+#define SR_NAT_TCP_TRANS_TO 300
+#define SR_NAT_UDP_TO       300
+#define SR_NAT_SYN_TO       6    /* an unsolicited SYN waits for a mapping */
+#define SR_NAT_SYN_PORTS    256  /* TCP ports a shard holds for them at once */
+#define SR_NAT_HASH_BITS  16
+#define SR_NAT_SHARD_BITS 3
+#define SR_NAT_SHARDS  (1 << SR_NAT_SHARD_BITS)
+#define SR_NAT_BUCKETS (1 << (SR_NAT_HASH_BITS - SR_NAT_SHARD_BITS)) /* chains
+                                                  per index of a shard */
 
 #define NAT_EXTERNAL_IF "eth2"
 #define NAT_INTERNAL_IF "eth1"
@@ -39,8 +52,29 @@ typedef enum {
   cache_entry_complete_hit
 } sr_nat_cache_entry_type;
 
+/* TCP connection states, driven by the flags of the packets translated */
+typedef enum {
+  nat_tcp_syn_sent,     /* SYN seen one way */
+  nat_tcp_established,  /* SYN seen both ways, or picked up mid flow */
+  nat_tcp_fin_wait,     /* FIN seen one way */
+  nat_tcp_time_wait     /* FIN seen both ways, or RST */
+} sr_nat_tcp_state;
+
+/* flags, one bit per direction */
+#define SR_NAT_DIR_INT 1  /* sent by the internal end */
+#define SR_NAT_DIR_EXT 2  /* sent by the external end */
+
+/* A TCP connection through a mapping, to one remote end. The first
+   unsolicited SYN waiting on a mapping is held as one too, with a copy of
+   the packet. */
 struct sr_nat_connection {
-  /* add TCP connection state data members here */
+  struct sr_timer timer;      /* idle timeout of its state, must be first */
+  struct sr_nat_mapping * mapping;
+  uint32_t ip_peer;           /* remote end, network byte order */
+  uint16_t aux_peer;
+  sr_nat_tcp_state state;
+  uint8_t syn;                /* SR_NAT_DIR_ of the SYNs seen */
+  uint8_t fin;                /* SR_NAT_DIR_ of the FINs seen */
   uint8_t * packet;
   unsigned int len;
   char * interface;
@@ -48,58 +82,129 @@ struct sr_nat_connection {
 };
 
 struct sr_nat_mapping {
+  struct sr_timer timer; /* idle timeout, must be first; TCP ones time out
+                            with their last connection instead */
   sr_nat_mapping_type type;
   uint32_t ip_int;  /* internal ip addr */
   uint32_t ip_ext;  /* external ip addr */
-  uint16_t aux_int; /* internal port or icmp id */
-  uint16_t aux_ext; /* external port or icmp id */
+  uint16_t aux_int; /* internal port or icmp id, network byte order */
+  uint16_t aux_ext; /* external port or icmp id, network byte order */
   time_t last_updated; /* use to timeout mappings */
   struct sr_nat_connection * conns; /* list of connections. null for ICMP */
-  struct sr_nat_mapping * next;
+  struct sr_nat_mapping * next;     /* in nat->mappings */
+  struct sr_nat_mapping * prev;
+  struct sr_nat_mapping * int_next; /* in its internal index bucket */
+  struct sr_nat_mapping * ext_next; /* in its external index bucket */
 };
 
+/* What rewriting a packet takes from its mapping, copied out by the
+   lookups into storage of the caller's, so no mapping leaves the lock. */
+struct sr_nat_xlate {
+  sr_nat_mapping_type type;
+  uint32_t ip_int;  /* network byte order, as in the mapping */
+  uint32_t ip_ext;
+  uint16_t aux_int;
+  uint16_t aux_ext;
+};
+
+
+/* External ports (ICMP ids) handed out, one bit per port, for each type of
+   mapping. A second level marks the words of used that are full, so a free
+   port is found by two find-first-zeros whatever the occupancy. Ports below
+   SR_NAT_PORT_MIN are never handed out. */
+#define SR_NAT_PORT_MIN   1024
+#define SR_NAT_PORT_WORDS (65536 / 64)
+
+struct sr_nat_ports {
+  uint64_t used[SR_NAT_PORT_WORDS];       /* bit set per port held */
+  uint64_t full[SR_NAT_PORT_WORDS / 64];  /* bit set per word of used full */
+  unsigned int next;                      /* word the search starts at */
+  unsigned int held;                      /* ports handed out */
+  unsigned int held_syn;                  /* of those, for unsolicited SYNs */
+  unsigned long exhausted;                /* requests that found none free */
+  unsigned long refused_syn;              /* SYNs over SR_NAT_SYN_PORTS */
+};
+
+/* The mappings are split over SR_NAT_SHARDS shards, each with its own
+   lock, indexes, ports and timer wheel, so translations of flows in
+   different shards never wait on each other or on the timeouts of other
+   shards. A mapping lives in the shard given by the low SR_NAT_SHARD_BITS
+   of its external port, and a shard only hands out ports of its own. New
+   mappings go to the shard their internal key hashes to, so either key
+   leads to the one shard that can hold the mapping.
+
+   In a shard, every mapping is on the mappings list and hashed by
+   (type, aux_ext) in ext_index. Complete mappings are also hashed by
+   (type, ip_int, aux_int) in int_index; those waiting on an unsolicited
+   SYN have no internal side yet. Both indexes chain through the mappings
+   themselves. */
+struct sr_nat_shard {
+  struct sr_nat * nat;
+  struct sr_nat_mapping * mappings;
+  struct sr_nat_mapping ** int_index; /* SR_NAT_BUCKETS chains */
+  struct sr_nat_mapping ** ext_index; /* SR_NAT_BUCKETS chains */
+  unsigned int count;                 /* mappings held */
+  struct sr_nat_ports ports[nat_mapping_unknown]; /* by mapping type */
+  struct sr_timer_wheel wheel;        /* runs its mappings' timeouts */
+  pthread_mutex_t lock;
+};
 
 struct sr_nat {
   /* add any fields here */
-  struct sr_nat_mapping * mappings;
+  struct sr_nat_shard shards[SR_NAT_SHARDS];
+  unsigned int icmp_to;               /* idle timeouts, s */
+  unsigned int tcp_est_to;
+  unsigned int tcp_trans_to;
+  struct sr_instance * sr;
   uint32_t ip_int;
   uint32_t ip_ext;
 
   /* threading */
-  pthread_mutex_t lock;
-  pthread_mutexattr_t attr;
+  pthread_mutexattr_t attr;           /* of every shard lock */
   pthread_attr_t thread_attr;
   pthread_t thread; /* time out thread */
 };
 
 int   sr_nat_init(struct sr_instance * sr, struct sr_nat * nat);     /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
-void *sr_natcache_timeout(void *nat_ptr);  /* Periodic Timout */
+void *sr_natcache_timeout(void *nat_ptr);  /* Runs every shard's timer wheel */
+/* Answers the SYNs held in conns with port unreachable. */
 void sr_nat_send_icmp3(struct sr_instance * sr, struct sr_nat_connection * conns);
-void sr_nat (struct sr_instance * sr, uint8_t * packet, unsigned int len,char * interace);
+/* Translates packet in place. Returns nonzero if it must be dropped
+   instead of handled, as when no external port is left for a new flow. */
+int sr_nat (struct sr_instance * sr, uint8_t * packet, unsigned int len,char * interace);
 
-/* remove natcache_entry from the nat */
+/* remove the mapping natcache_entry is, or is a copy of, from the nat */
 void
 sr_nat_remove_entry(
   struct sr_nat * nat,
   struct sr_nat_mapping * natcache_entry);
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping * sr_nat_lookup_external(
+/* Looks up the mapping of external port aux_ext. A complete hit is copied
+   into xlate and, unless packet is NULL, has packet noted against it in
+   the same critical section: its idle timeout restarts and, for TCP, the
+   connection packet belongs to moves state, opened if need be. A partial
+   hit, a mapping held for unsolicited SYNs, is neither copied nor noted. */
+sr_nat_cache_entry_type sr_nat_lookup_external(
   struct sr_nat *nat,
   uint16_t aux_ext,
-  sr_nat_mapping_type type);
+  sr_nat_mapping_type type,
+  uint8_t * packet,
+  struct sr_nat_xlate * xlate);
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping * sr_nat_lookup_internal(
+/* Likewise for the mapping of internal (ip, port) pair, with packet going
+   out. Only complete mappings are indexed this way, so it never returns a
+   partial hit. */
+sr_nat_cache_entry_type sr_nat_lookup_internal(
   struct sr_nat *nat,
   uint32_t ip_int,
   uint16_t aux_int,
-  sr_nat_mapping_type type);
+  sr_nat_mapping_type type,
+  uint8_t * packet,
+  struct sr_nat_xlate * xlate);
 
-/* Append a connection to the mapping given by aux_ext. */
+/* Append a copy of an unsolicited SYN to the mapping held for it at
+   aux_ext, unless the mapping already has one. */
 void
 sr_nat_append_connection(
   struct sr_nat * nat,
@@ -107,19 +212,28 @@ sr_nat_append_connection(
   uint16_t aux_ext,
   unsigned long len);
 
-/* Insert a new external mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
+/* Insert a new external mapping into the nat's mapping table, holding
+   port aux_ext for unsolicited SYNs for SR_NAT_SYN_TO seconds. Once its
+   shard holds SR_NAT_SYN_PORTS such ports, the SYN is refused instead, so
+   a SYN flood cannot starve new flows of ports. */
 void
 sr_nat_insert_syn(
   struct sr_instance * sr,
   uint16_t aux_ext);
 
-/* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping * sr_nat_insert_mapping(
+/* Insert a new mapping into the nat's mapping table, on an external port
+   of its own, copying it into xlate and noting packet against it as
+   sr_nat_lookup_internal does. If the internal pair was mapped since it
+   was looked up, that mapping is used instead, so a flow gets one mapping
+   however many workers see its first packets. Returns -1 if every port
+   is taken, else 0. */
+int
+sr_nat_insert_mapping(
   struct sr_instance * sr,
   uint32_t ip_int,
   uint16_t aux_int,
-  sr_nat_mapping_type type);
+  sr_nat_mapping_type type,
+  uint8_t * packet,
+  struct sr_nat_xlate * xlate);
 #endif
 
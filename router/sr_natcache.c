@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 
 #include "sr_nat.h"
 #include "sr_router.h"
@@ -17,33 +19,55 @@ sr_nat_drop_syns(struct sr_nat_mapping * natcache_entry)
 
   while(conns != NULL) {
     temp = conns->next;
+    sr_timer_del(&(conns->timer));
+    free(conns->packet);
     free(conns);
     conns = temp;
   }
+  natcache_entry->conns = NULL;
   return;
 }
 
+/* The mapping natcache_entry is, or is a copy of, found by its key in the
+   shard holding it. Caller holds the shard's lock. */
+static struct sr_nat_mapping *
+sr_nat_find_entry(
+  struct sr_nat_shard * shard,
+  struct sr_nat_mapping * natcache_entry)
+{
+  struct sr_nat_mapping * curr;
+
+  curr = sr_nat_search_ext_nat_mappings(shard,natcache_entry->aux_ext,
+      natcache_entry->type);
+  while(curr && curr != natcache_entry
+      && !(   curr->type    == natcache_entry->type
+           && curr->aux_ext == natcache_entry->aux_ext
+           && curr->ip_int  == natcache_entry->ip_int
+           && curr->aux_int == natcache_entry->aux_int)) {
+    curr = curr->ext_next;
+  }
+  return curr;
+}
+
 void
 sr_nat_remove_entry(
   struct sr_nat * nat,
   struct sr_nat_mapping * natcache_entry)
 {
-  struct sr_nat_mapping ** prev = &(nat->mappings);
-  struct sr_nat_mapping * curr = nat->mappings;
+  struct sr_nat_shard * shard = sr_nat_ext_shard(nat,natcache_entry->aux_ext);
+  struct sr_nat_mapping * curr;
 
-  /* eieio - ugly hacks */
-  pthread_mutex_lock(&(nat->lock));
+  pthread_mutex_lock(&(shard->lock));
 
-  while(curr) {
-    if(curr == natcache_entry) {
-      *prev = curr->next;
-      free(curr);
-      break;
-    }
-    *prev = curr;
-    curr = curr->next;
+  curr = sr_nat_find_entry(shard,natcache_entry);
+  if(curr) {
+    sr_timer_del(&(curr->timer));
+    sr_nat_unlink_nat_mapping(shard,curr);
+    sr_nat_drop_syns(curr);
+    free(curr);
   }
-  pthread_mutex_unlock(&(nat->lock));
+
+  pthread_mutex_unlock(&(shard->lock));
   return;
 }
 
@@ -52,87 +76,213 @@ sr_nat_send_icmp3 (
   struct sr_instance * sr,
   struct sr_nat_connection * conns)
 {
-  struct sr_nat_connection * temp = NULL;
+  while(conns != NULL) {
+    if(conns->packet)
+      sr_send_icmp3(sr,conns->packet,conns->len,conns->interface,icmp3_port);
+    conns = conns->next;
+  }
+}
 
-  if (conns == NULL) { return; }
+/* ---< timeouts >----------------------------------------------------------- */
+/* Run by a shard's wheel with its lock held. A mapping's own timer ends an idle
+   ICMP or UDP mapping, or one held for unsolicited SYNs, which are then
+   refused. */
+static void
+sr_nat_expire_mapping(struct sr_timer * timer, void * shard_ptr)
+{
+  struct sr_nat_shard * shard = shard_ptr;
+  struct sr_nat_mapping * mapping = (struct sr_nat_mapping *)timer;
 
-  while(conns != NULL) {
-    sr_send_icmp3(sr,conns->packet,conns->len,conns->interface,icmp3_port);
-    temp = conns->next;
-    free(conns);
-    conns = temp;
+  sr_nat_send_icmp3(shard->nat->sr,mapping->conns);
+  sr_nat_remove_entry(shard->nat,mapping);
+}
+
+/* A TCP connection idle past its state's timeout is dropped, and its
+   mapping with it once it was the last. */
+static void
+sr_nat_expire_connection(struct sr_timer * timer, void * shard_ptr)
+{
+  struct sr_nat_shard * shard = shard_ptr;
+  struct sr_nat_connection * conn = (struct sr_nat_connection *)timer;
+  struct sr_nat_mapping * mapping = conn->mapping;
+  struct sr_nat_connection ** it = &(mapping->conns);
+
+  while(*it != conn) { it = &((*it)->next); }
+  *it = conn->next;
+  free(conn->packet);
+  free(conn);
+
+  if(mapping->conns == NULL)
+    sr_nat_remove_entry(shard->nat,mapping);
+}
+
+static void
+sr_nat_track_tcp(
+  struct sr_nat_shard * shard,
+  struct sr_nat_mapping * mapping,
+  uint8_t * packet,
+  int internal)
+{
+  uint32_t ip_peer = internal ? sr_get_ip_dst(packet) : sr_get_ip_src(packet);
+  uint16_t aux_peer = internal ? sr_get_tcp_dst(packet) : sr_get_tcp_src(packet);
+  uint8_t dir = internal ? SR_NAT_DIR_INT : SR_NAT_DIR_EXT;
+  struct sr_nat * nat = shard->nat;
+  struct sr_nat_connection * conn;
+
+  for(conn = mapping->conns; conn; conn = conn->next) {
+    if(conn->packet == NULL
+        && conn->ip_peer == ip_peer && conn->aux_peer == aux_peer)
+      break;
+  }
+  /* -- a peer outside only opens a connection with a SYN, so stray or
+        spoofed segments cost nothing; an inside host may pick one up mid
+        flow -- */
+  if(conn == NULL && !internal && !sr_get_tcp_syn(packet))
+    return;
+  if(conn == NULL) {
+    conn = sr_nat_allocate_nat_connection();
+    sr_nat_construct_nat_connection(conn,NULL,0,NULL);
+    sr_timer_init(&(conn->timer),sr_nat_expire_connection,shard);
+    conn->mapping = mapping;
+    conn->ip_peer = ip_peer;
+    conn->aux_peer = aux_peer;
+    conn->state = sr_get_tcp_syn(packet) ? nat_tcp_syn_sent
+      : nat_tcp_established;
+    conn->next = mapping->conns;
+    mapping->conns = conn;
+    /* -- its connections time the mapping out from now on -- */
+    sr_timer_del(&(mapping->timer));
+  }
+
+  /* -- a SYN on a closed connection is a new one on the same tuple -- */
+  if(sr_get_tcp_syn(packet) && conn->state == nat_tcp_time_wait) {
+    conn->state = nat_tcp_syn_sent;
+    conn->syn = 0;
+    conn->fin = 0;
+  }
+
+  if(sr_get_tcp_syn(packet))
+    conn->syn |= dir;
+  if(sr_get_tcp_fin(packet))
+    conn->fin |= dir;
+
+  if(sr_get_tcp_rst(packet)
+      || conn->fin == (SR_NAT_DIR_INT | SR_NAT_DIR_EXT)) {
+    conn->state = nat_tcp_time_wait;
+  } else if(conn->fin) {
+    conn->state = nat_tcp_fin_wait;
+  } else if(conn->state == nat_tcp_syn_sent
+      && conn->syn == (SR_NAT_DIR_INT | SR_NAT_DIR_EXT)) {
+    conn->state = nat_tcp_established;
   }
+
+  sr_timer_add(&(shard->wheel),&(conn->timer),1000UL *
+      (conn->state == nat_tcp_established ? nat->tcp_est_to
+       : nat->tcp_trans_to));
+}
+
+/* Notes packet, translated with mapping, against it: restarts its idle
+   timeout, or moves the state of its TCP connection. */
+static void
+sr_nat_touch(
+  struct sr_nat_shard * shard,
+  struct sr_nat_mapping * mapping,
+  uint8_t * packet,
+  int internal)
+{
+  mapping->last_updated = time(NULL);
+  if(mapping->type == nat_mapping_tcp)
+    sr_nat_track_tcp(shard,mapping,packet,internal);
+  else
+    sr_timer_add(&(shard->wheel),&(mapping->timer),1000UL *
+        (mapping->type == nat_mapping_icmp ? shard->nat->icmp_to
+         : SR_NAT_UDP_TO));
+}
+
+static void
+sr_nat_copy_xlate(
+  struct sr_nat_xlate * xlate,
+  struct sr_nat_mapping * mapping)
+{
+  xlate->type = mapping->type;
+  xlate->ip_int = mapping->ip_int;
+  xlate->ip_ext = mapping->ip_ext;
+  xlate->aux_int = mapping->aux_int;
+  xlate->aux_ext = mapping->aux_ext;
 }
 
 void *
-sr_natcache_timeout(void * sr_ptr) {
-  struct sr_instance * sr = (struct sr_instance *)sr_ptr;
-  struct sr_nat * nat = ((struct sr_instance *)sr_ptr)->nat;
-  struct sr_nat_mapping * map_it = NULL;
-  struct sr_nat_mapping * temp = NULL;
+sr_natcache_timeout(void * nat_ptr) {
+  struct sr_nat * nat = nat_ptr;
+  struct timespec tick = { 0, SR_TIMER_TICK_MS * 1000000L };
+  uint64_t now;
+  int i;
 
   while (1) {
-    sleep(5.0); /* eieio - dirty hack */
-
-    pthread_mutex_lock(&(nat->lock));
-    time_t curtime = time(NULL);
-    map_it = nat->mappings;
-
-    while(map_it != NULL) {
-      if(difftime(curtime,map_it->last_updated) > SR_NAT_TO) {
-        sr_nat_send_icmp3(sr,map_it->conns);
-        temp = map_it->next;
-        sr_nat_remove_entry(nat,map_it);
-      }
-      map_it = temp;
+    nanosleep(&tick, NULL);
+
+    /* -- one shard at a time, so translations wait on one at most -- */
+    now = sr_timer_clock();
+    for (i = 0; i < SR_NAT_SHARDS; i++) {
+      pthread_mutex_lock(&(nat->shards[i].lock));
+      sr_timer_run(&(nat->shards[i].wheel), now);
+      pthread_mutex_unlock(&(nat->shards[i].lock));
     }
-    pthread_mutex_unlock(&(nat->lock));
   }
   return NULL;
 }
 
-struct sr_nat_mapping *
+sr_nat_cache_entry_type
 sr_nat_lookup_external (
   struct sr_nat * nat,
   uint16_t aux_ext,
-  sr_nat_mapping_type type)
+  sr_nat_mapping_type type,
+  uint8_t * packet,
+  struct sr_nat_xlate * xlate)
 {
+  struct sr_nat_shard * shard = sr_nat_ext_shard(nat,aux_ext);
   struct sr_nat_mapping * needle;
-  struct sr_nat_mapping * copy = NULL;
-
-  pthread_mutex_lock(&(nat->lock));
-  needle = sr_nat_search_ext_nat_mappings(nat->mappings,aux_ext,type);
-  if(needle) {
-    copy = sr_nat_allocate_nat_mapping();
-    sr_nat_memcpy_nat_mapping(copy,needle);
+  sr_nat_cache_entry_type entry_type = cache_entry_miss;
+
+  pthread_mutex_lock(&(shard->lock));
+  needle = sr_nat_search_ext_nat_mappings(shard,aux_ext,type);
+  if(needle && !needle->ip_int) {
+    entry_type = cache_entry_partial_hit;
+  } else if(needle) {
+    entry_type = cache_entry_complete_hit;
+    sr_nat_copy_xlate(xlate,needle);
+    if(packet)
+      sr_nat_touch(shard,needle,packet,0);
   }
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&(shard->lock));
 
-
-  return copy;
+  return entry_type;
 }
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *
+sr_nat_cache_entry_type
 sr_nat_lookup_internal (
   struct sr_nat *nat,
-   uint32_t ip_int,
+  uint32_t ip_int,
   uint16_t aux_int,
-  sr_nat_mapping_type type)
+  sr_nat_mapping_type type,
+  uint8_t * packet,
+  struct sr_nat_xlate * xlate)
 {
-  struct sr_nat_mapping * copy = NULL;
+  struct sr_nat_shard * shard = sr_nat_int_shard(nat,ip_int,aux_int,type);
   struct sr_nat_mapping * needle;
+  sr_nat_cache_entry_type entry_type = cache_entry_miss;
 
-  pthread_mutex_lock(&(nat->lock));
-  needle = sr_nat_search_int_nat_mappings(nat->mappings,ip_int,aux_int,type);
+  pthread_mutex_lock(&(shard->lock));
+  needle = sr_nat_search_int_nat_mappings(shard,ip_int,aux_int,type);
   if(needle) {
-    copy = sr_nat_allocate_nat_mapping();
-    sr_nat_memcpy_nat_mapping(copy,needle);
+    entry_type = cache_entry_complete_hit;
+    sr_nat_copy_xlate(xlate,needle);
+    if(packet)
+      sr_nat_touch(shard,needle,packet,1);
   }
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_unlock(&(shard->lock));
 
-  return copy;
+  return entry_type;
 }
 
 void
@@ -142,19 +292,22 @@ sr_nat_append_connection (
   uint16_t aux_ext,
   unsigned long len)
 {
+  struct sr_nat_shard * shard = sr_nat_ext_shard(nat,aux_ext);
   struct sr_nat_mapping * needle;
-  struct sr_nat_connection * conn = sr_nat_allocate_nat_connection();
-
-  /* we only use this for external mapping */
-  sr_nat_construct_nat_connection(conn, packet, len, NAT_EXTERNAL_IF);
-
-  pthread_mutex_lock(&(nat->lock));
-  needle = sr_nat_search_ext_nat_mappings(nat->mappings,aux_ext,nat_mapping_tcp);
-  if(needle) {
+  struct sr_nat_connection * conn;
+
+  pthread_mutex_lock(&(shard->lock));
+  needle = sr_nat_search_ext_nat_mappings(shard,aux_ext,nat_mapping_tcp);
+  /* -- one SYN is enough to answer for when the mapping expires, so the
+        rest of a flood to the port costs nothing -- */
+  if(needle && !needle->ip_int && needle->conns == NULL) {
+    conn = sr_nat_allocate_nat_connection();
+    /* we only use this for external mapping */
+    sr_nat_construct_nat_connection(conn, packet, len, NAT_EXTERNAL_IF);
+    conn->mapping = needle;
     needle->conns = sr_nat_append_mapping_connection(needle->conns, conn);
   }
-  pthread_mutex_unlock(&(nat->lock));
-
+  pthread_mutex_unlock(&(shard->lock));
   return;
 }
 
@@ -163,35 +316,76 @@ sr_nat_insert_syn (
   struct sr_instance * sr,
   uint16_t aux_ext)
 {
-  struct sr_nat * nat = sr->nat;
+  struct sr_nat_shard * shard = sr_nat_ext_shard(sr->nat,aux_ext);
+  struct sr_nat_ports * ports = &(shard->ports[nat_mapping_tcp]);
   struct sr_nat_mapping * mapping = sr_nat_allocate_nat_mapping();
 
   sr_nat_construct_nat_mapping_external(sr,mapping,aux_ext,nat_mapping_tcp);
+  sr_timer_init(&(mapping->timer),sr_nat_expire_mapping,shard);
+
+  pthread_mutex_lock(&(shard->lock));
+  /* -- a mapping may have taken the port since it was looked up -- */
+  if(ports->held_syn >= SR_NAT_SYN_PORTS) {
+    ports->refused_syn++;
+  } else if(sr_nat_take_port(ports,ntohs(aux_ext)) == 0) {
+    ports->held_syn++;
+    sr_nat_link_nat_mapping(shard,mapping);
+    sr_timer_add(&(shard->wheel),&(mapping->timer),SR_NAT_SYN_TO * 1000UL);
+    mapping = NULL;
+  }
+  pthread_mutex_unlock(&(shard->lock));
 
-  pthread_mutex_lock(&(nat->lock));
-  nat->mappings = sr_nat_append_nat_mappings(nat->mappings, mapping);
-  pthread_mutex_unlock(&(nat->lock));
-
+  free(mapping);
   return;
 }
 
-struct sr_nat_mapping *
+int
 sr_nat_insert_mapping (
   struct sr_instance * sr,
   uint32_t ip_int,
   uint16_t aux_int,
-  sr_nat_mapping_type type)
+  sr_nat_mapping_type type,
+  uint8_t * packet,
+  struct sr_nat_xlate * xlate)
 {
-  struct sr_nat * nat = sr->nat;
-  struct sr_nat_mapping * copy = sr_nat_allocate_nat_mapping();
+  struct sr_nat_shard * shard = sr_nat_int_shard(sr->nat,ip_int,aux_int,type);
   struct sr_nat_mapping * mapping = sr_nat_allocate_nat_mapping();
+  struct sr_nat_mapping * needle;
+  int port;
 
   sr_nat_construct_nat_mapping(sr,mapping,ip_int,aux_int,type);
-  sr_nat_memcpy_nat_mapping(copy,mapping);
+  sr_timer_init(&(mapping->timer),sr_nat_expire_mapping,shard);
 
-  pthread_mutex_lock(&(nat->lock));
-  nat->mappings = sr_nat_append_nat_mappings(nat->mappings,mapping);
-  pthread_mutex_unlock(&(nat->lock));
+  pthread_mutex_lock(&(shard->lock));
+  /* -- another worker may have mapped the flow since it was looked up -- */
+  needle = sr_nat_search_int_nat_mappings(shard,ip_int,aux_int,type);
+  if(needle) {
+    sr_nat_copy_xlate(xlate,needle);
+    if(packet)
+      sr_nat_touch(shard,needle,packet,1);
+    pthread_mutex_unlock(&(shard->lock));
+    free(mapping);
+    return 0;
+  }
+  /* -- the shard's ports keep the mapping in the shard by either key -- */
+  port = sr_nat_alloc_port(&(shard->ports[type]));
+  if(port >= 0) {
+    mapping->aux_ext = htons((uint16_t)port);
+    sr_nat_link_nat_mapping(shard,mapping);
+    /* -- in case no packet picks the right one -- */
+    sr_timer_add(&(shard->wheel),&(mapping->timer),1000UL *
+        (type == nat_mapping_tcp ? sr->nat->tcp_trans_to : SR_NAT_UDP_TO));
+    sr_nat_copy_xlate(xlate,mapping);
+    if(packet)
+      sr_nat_touch(shard,mapping,packet,1);
+  }
+  pthread_mutex_unlock(&(shard->lock));
 
-  return copy;
+  if(port < 0) {
+    NAT_PRINTD("no %s port left for a new mapping\n",
+        type == nat_mapping_icmp ? "icmp" : type == nat_mapping_tcp ? "tcp" : "udp");
+    free(mapping);
+    return -1;
+  }
+  return 0;
 }
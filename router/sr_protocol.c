@@ -94,12 +94,14 @@ sr_validate_icmp11 (uint8_t * packet, unsigned int len)
 _Bool
 sr_validate_tcp (uint8_t * packet, unsigned int len)
 {
-  return 0; /* TODO */
+  if(len < TCP_LEN) return 1;
+  return 0;
 }
 _Bool
 sr_validate_udp (uint8_t * packet, unsigned int len)
 {
-  return 0; /* TODO */
+  if(len < UDP_LEN) return 1;
+  return 0;
 }
 
 /* ==< compute and set checksums >=========================================== */
@@ -131,17 +133,44 @@ void
 sr_compute_set_icmp11_sum (uint8_t * packet) {
   sr_compute_set_icmp_sum(packet,ICMP11_HDR_LEN);
 }
+/* Sums the segment in place, pseudo header first: addresses, protocol and
+   segment length. */
 void
 sr_compute_set_tcp_sum (uint8_t * packet) {
-  uint16_t tcp_data_len = sr_get_tcp_data_len(packet);
-  uint16_t total_len = TCP_PSEUDO_HDR_LEN + tcp_data_len;
-  uint8_t * tcp_pseudo_header  = alloca(total_len);
-
-  sr_set_tcp_pseudo_header(packet,tcp_pseudo_header);
-  sr_cpy_tcp_data(packet,tcp_pseudo_header + TCP_PSEUDO_HDR_LEN);
+  uint16_t tcp_len = ntohs(sr_get_ip_len(packet)) - sr_get_ip_hl(packet) * 4;
+  const uint8_t * data = TCP_HDR(packet);
+  uint32_t sum = ip_protocol_tcp + tcp_len;
+  int i;
+
+  for(i = 12; i < 20; i += 2)
+    sum += IP_HDR(packet)[i] << 8 | IP_HDR(packet)[i + 1];
+
+  sr_set_tcp_sum(packet,0);
+  for(i = 0; i + 1 < tcp_len; i += 2)
+    sum += data[i] << 8 | data[i + 1];
+  if(i < tcp_len)
+    sum += data[i] << 8;
+  while(sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  sr_set_tcp_sum(packet,htons(~sum & 0xffff));
+}
+/* ==< incremental checksum updates >======================================== */
+/* HC' = ~(~HC + ~m + m'), summed in one's complement. The sum is the same
+   whichever byte order its words are read in, so they stay as they are. */
+uint16_t
+sr_sum_adjust16 (uint16_t sum, uint16_t old, uint16_t new)
+{
+  uint32_t s = (uint16_t)~sum + (uint32_t)(uint16_t)~old + new;
 
-  uint16_t checksum = cksum(tcp_pseudo_header,total_len);
-  sr_set_tcp_sum(packet,checksum);
+  s = (s >> 16) + (s & 0xffff);
+  s += s >> 16;
+  return (uint16_t)~s;
+}
+uint16_t
+sr_sum_adjust32 (uint16_t sum, uint32_t old, uint32_t new)
+{
+  sum = sr_sum_adjust16(sum,(uint16_t)(old >> 16),(uint16_t)(new >> 16));
+  return sr_sum_adjust16(sum,(uint16_t)old,(uint16_t)new);
 }
 /* ==< header copy routines >================================================ */
 void
@@ -444,7 +473,7 @@ sr_set_udp_src (uint8_t * p, uint16_t udp_src)
 void
 sr_set_udp_dst (uint8_t * p, uint16_t udp_dst)
 {
-  ((sr_udp_hdr_t*) (UDP_HDR(p)))->udp_src = udp_dst;
+  ((sr_udp_hdr_t*) (UDP_HDR(p)))->udp_dst = udp_dst;
 }
 void
 sr_set_udp_len (uint8_t * p, uint16_t udp_len)
@@ -490,7 +519,7 @@ sr_set_tcp_src (uint8_t * p, uint16_t tcp_src)
 void
 sr_set_tcp_dst (uint8_t * p, uint16_t tcp_dst)
 {
-  ((sr_tcp_hdr_t*) (TCP_HDR(p)))->tcp_src = tcp_dst;
+  ((sr_tcp_hdr_t*) (TCP_HDR(p)))->tcp_dst = tcp_dst;
 }
 void
 sr_set_tcp_hl (uint8_t * p, uint8_t tcp_hl)
@@ -500,7 +529,7 @@ sr_set_tcp_hl (uint8_t * p, uint8_t tcp_hl)
 void
 sr_set_tcp_syn (uint8_t * p, uint8_t tcp_syn)
 {
-  ((sr_tcp_hdr_t*) (TCP_HDR(p)))->tcp_hl = tcp_syn;
+  ((sr_tcp_hdr_t*) (TCP_HDR(p)))->tcp_syn = tcp_syn;
 }
 void
 sr_set_tcp_sum (uint8_t * p, uint16_t tcp_sum)
@@ -528,6 +557,16 @@ sr_get_tcp_syn (uint8_t * p)
 {
   return ((sr_tcp_hdr_t *) (TCP_HDR(p)))->tcp_syn;
 }
+uint8_t
+sr_get_tcp_fin (uint8_t * p)
+{
+  return ((sr_tcp_hdr_t *) (TCP_HDR(p)))->tcp_fin;
+}
+uint8_t
+sr_get_tcp_rst (uint8_t * p)
+{
+  return ((sr_tcp_hdr_t *) (TCP_HDR(p)))->tcp_rst;
+}
 uint16_t
 sr_get_tcp_sum (uint8_t * p)
 {
@@ -542,27 +581,11 @@ sr_get_tcp_data (uint8_t * p) {
 uint16_t
 sr_get_tcp_data_len (uint8_t * p)
 {
-  uint16_t ip_len = sr_get_ip_len(p);
+  uint16_t ip_len = ntohs(sr_get_ip_len(p));
   uint8_t  ip_hl  = sr_get_ip_hl(p);
   uint8_t tcp_hl  = sr_get_tcp_hl(p);
   return ip_len - (ip_hl + tcp_hl) * 4;
 }
-void
-sr_set_tcp_pseudo_header (uint8_t * p, uint8_t * q)
-{
-  sr_tcp_pseudo_hdr_t * h =  (sr_tcp_pseudo_hdr_t * ) q;
-  h->u32[0] = sr_get_ip_src(p);
-  h->u32[1] = sr_get_ip_dst(p);
-  h->u8[8]  = 0;
-  h->u8[9]  = sr_get_ip_p(p);
-  h->u16[5] = sr_get_ip_len(p);
-}
-void
-sr_cpy_tcp_data (uint8_t * src, uint8_t * dst)
-{
-  uint16_t tcp_data_len = sr_get_tcp_data_len(src);
-  memcpy(dst,sr_get_tcp_data(src),tcp_data_len);
-}
 /* ==< end udp >============================================================= */
 
 
@@ -77,7 +77,7 @@
 #define ICMP8_HDR_LEN       8
 #define ICMP11_HDR_LEN      36
 #define UDP_HDR_LEN         8
-#define TCP_HDR_LEN         40
+#define TCP_HDR_LEN         20
 #define TCP_PSEUDO_HDR_LEN  12
 
 /* =< min messages sizes >=================================================== */
@@ -88,7 +88,7 @@
 #define ICMP3_LEN     ETH_HDR_LEN + IP_HDR_LEN + ICMP3_HDR_LEN
 #define ICMP8_LEN     ETH_HDR_LEN + IP_HDR_LEN + ICMP8_HDR_LEN
 #define ICMP11_LEN    ETH_HDR_LEN + IP_HDR_LEN + ICMP11_HDR_LEN
-#define UPD_LEN       EHT_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN
+#define UDP_LEN       ETH_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN
 #define TCP_LEN       ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN
 
 /* =< base pointer to header pointer conversions >=========================== */
@@ -146,6 +146,13 @@ void sr_compute_set_ip_sum     (uint8_t * p);
 void sr_compute_set_tcp_sum    (uint8_t * p);
 /* ==< end compute and set icmp checksums >================================== */
 
+/* ==< incremental checksum updates >======================================== */
+/* The internet checksum sum once a 16 or 32-bit field it covers goes from
+   old to new (RFC 1624, eqn. 3). All values in network byte order. */
+uint16_t sr_sum_adjust16 (uint16_t sum, uint16_t old, uint16_t new);
+uint16_t sr_sum_adjust32 (uint16_t sum, uint32_t old, uint32_t new);
+/* ==< end incremental checksum updates >==================================== */
+
 /* ==< icmp header >========================================================= */
 struct sr_icmp_hdr {
   uint8_t icmp_type;
@@ -346,7 +353,7 @@ struct sr_tcp_hdr {
   uint8_t tcp_syn:1;
   uint8_t tcp_fin:1;
 #endif
-  uint8_t  tcp_win_size;
+  uint16_t tcp_win_size;
   uint16_t tcp_sum;
   uint16_t tcp_urg_ptr;
 } __attribute__ ((packed));
@@ -362,12 +369,12 @@ uint16_t sr_get_tcp_src       (uint8_t * p);
 uint16_t sr_get_tcp_dst       (uint8_t * p);
 uint8_t sr_get_tcp_hl         (uint8_t * p);
 uint8_t sr_get_tcp_syn        (uint8_t * p);
+uint8_t sr_get_tcp_fin        (uint8_t * p);
+uint8_t sr_get_tcp_rst        (uint8_t * p);
 uint16_t sr_get_tcp_sum       (uint8_t * p);
 uint8_t * sr_get_tcp_data     (uint8_t * p);
 /* =< tcp misc routines >==================================================== */
 uint16_t sr_get_tcp_data_len  (uint8_t * p);
-void sr_set_tcp_pseudo_header (uint8_t * p, uint8_t * q);
-void sr_cpy_tcp_data          (uint8_t * src, uint8_t * dst);
 /* ==< end tcp header >====================================================== */
 
 /* ==< udp header >========================================================== */
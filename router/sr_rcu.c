@@ -0,0 +1,74 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sr_rcu.h"
+
+/* --< constructor >--------------------------------------------------------- */
+void
+sr_rcu_init (struct sr_rcu * rcu)
+{
+  rcu->epoch = 0;
+  rcu->readers[0] = 0;
+  rcu->readers[1] = 0;
+  rcu->deferred = NULL;
+  rcu->ndeferred = 0;
+  rcu->deferred_cap = 0;
+  pthread_mutex_init(&(rcu->lock),NULL);
+}
+/* --< readers >------------------------------------------------------------- */
+int
+sr_rcu_read_lock (struct sr_rcu * rcu)
+{
+  int idx = __atomic_load_n(&(rcu->epoch),__ATOMIC_SEQ_CST) & 1;
+  __atomic_add_fetch(&(rcu->readers[idx]),1,__ATOMIC_SEQ_CST);
+  return idx;
+}
+
+void
+sr_rcu_read_unlock (struct sr_rcu * rcu, int idx)
+{
+  __atomic_sub_fetch(&(rcu->readers[idx]),1,__ATOMIC_SEQ_CST);
+}
+/* --< writers >------------------------------------------------------------- */
+/* A reader can read the epoch just before a flip and count itself in the
+   old parity just after the writer saw it drain, so one flip is not enough:
+   flip twice, draining each parity in turn. */
+void
+sr_rcu_synchronize (struct sr_rcu * rcu)
+{
+  unsigned long old;
+  int i;
+
+  pthread_mutex_lock(&(rcu->lock));
+  for(i = 0; i < 2; i++) {
+    old = __atomic_fetch_add(&(rcu->epoch),1,__ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&(rcu->readers[old & 1]),__ATOMIC_SEQ_CST) != 0)
+      usleep(1000);
+  }
+  pthread_mutex_unlock(&(rcu->lock));
+}
+
+void
+sr_rcu_defer_free (struct sr_rcu * rcu, void * p)
+{
+  if(p == NULL) return;
+
+  if(rcu->ndeferred == rcu->deferred_cap) {
+    rcu->deferred_cap = rcu->deferred_cap ? rcu->deferred_cap * 2 : 64;
+    rcu->deferred = realloc(rcu->deferred,rcu->deferred_cap * sizeof(void *));
+    assert(rcu->deferred);
+  }
+  rcu->deferred[rcu->ndeferred++] = p;
+}
+
+void
+sr_rcu_reclaim (struct sr_rcu * rcu)
+{
+  unsigned int i;
+
+  sr_rcu_synchronize(rcu);
+  for(i = 0; i < rcu->ndeferred; i++)
+    free(rcu->deferred[i]);
+  rcu->ndeferred = 0;
+}
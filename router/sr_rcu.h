@@ -0,0 +1,55 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_rcu.h
+ *
+ * Description:
+ *
+ * Read-copy-update for data the packet path reads while another thread
+ * replaces it. Readers bracket their use of the shared pointer with
+ * sr_rcu_read_lock/unlock and never wait. A writer publishes the new copy
+ * with an atomic store, calls sr_rcu_synchronize, and only then frees the
+ * old copy. Writers making many small changes can hand what they unlink to
+ * sr_rcu_defer_free and pay for one grace period per batch in
+ * sr_rcu_reclaim.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_RCU_H
+#define SR_RCU_H
+
+#include <pthread.h>
+
+struct sr_rcu {
+  unsigned long epoch;           /* low bit picks the counter new readers use */
+  unsigned long readers[2];      /* readers that entered under each parity */
+  pthread_mutex_t lock;          /* one grace period at a time */
+
+  /* unlinked memory waiting for a grace period, writers only */
+  void ** deferred;
+  unsigned int ndeferred;
+  unsigned int deferred_cap;
+};
+
+void sr_rcu_init(struct sr_rcu * rcu);
+
+/* Enters a read side critical section. Pass the returned value to the
+   matching sr_rcu_read_unlock. Sections may nest. */
+int  sr_rcu_read_lock(struct sr_rcu * rcu);
+void sr_rcu_read_unlock(struct sr_rcu * rcu, int idx);
+
+/* Returns once every read side critical section that was running when it
+   was called has finished. Polls, so only writers should call it. */
+void sr_rcu_synchronize(struct sr_rcu * rcu);
+
+/* Frees p after the next grace period. Callers must serialize, as writers
+   already do. */
+void sr_rcu_defer_free(struct sr_rcu * rcu, void * p);
+
+/* Waits for a grace period and frees everything deferred before it. */
+void sr_rcu_reclaim(struct sr_rcu * rcu);
+
+/* Loads a pointer published by a writer. */
+#define sr_rcu_dereference(p) __atomic_load_n(&(p),__ATOMIC_ACQUIRE)
+/* Publishes a fully initialized object to readers. */
+#define sr_rcu_assign_pointer(p,v) __atomic_store_n(&(p),(v),__ATOMIC_RELEASE)
+
+#endif /* -- SR_RCU_H -- */
@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <signal.h>
 
+#include "sr_adj.h"
 #include "sr_if.h"
 #include "sr_rt.h"
 #include "sr_router.h"
@@ -16,6 +18,25 @@ static unsigned char BROADCAST[ETHER_ADDR_LEN];
 struct sr_if * sr_ip_addressed_to_router(struct sr_instance * sr,uint8_t * packet);
 
 /* ==< send routines >======================================================= */
+/* =< queue for arp >======================================================== */
+/* Holds packet until nexthop resolves. A new request goes out straight
+   away, the cache's timers send it again. The lock keeps the timeout thread
+   from destroying the request in between. */
+static void
+sr_queue_arp (struct sr_instance * sr,
+    uint32_t nexthop,
+    uint8_t * packet/* lent */,
+    unsigned int len,
+    char * interface/* lent */)
+{
+  struct sr_arpreq * arpreq;
+  pthread_mutex_lock(&(sr->cache.lock));
+  arpreq = sr_arpcache_queuereq(&(sr->cache),nexthop,packet,len,interface);
+  if(arpreq->times_sent == 0)
+    sr_handle_arpreq(sr,arpreq);
+  pthread_mutex_unlock(&(sr->cache.lock));
+}
+/* =< end queue for arp >==================================================== */
 /* =< send ethernet >======================================================== */
 static void
 sr_send_eth (struct sr_instance * sr,
@@ -24,22 +45,17 @@ sr_send_eth (struct sr_instance * sr,
     char * interface/* lent */,
     _Bool dofree)
 {
-  struct sr_arpentry * arpentry;
-  struct sr_arpreq * arpreq;
+  unsigned char mac[ETHER_ADDR_LEN];
   struct sr_if * iface;
   if(sr_get_eth_type(packet) == htons(ethertype_ip) /* IP */) {
     iface = sr_get_interface(sr, interface);
     sr_set_eth_shost(packet,iface->addr);
-    arpentry = sr_arpcache_lookup(&(sr->cache),sr_get_ip_dst(packet));
-    if(arpentry) {  /* arp cache hit */
-      sr_set_eth_dhost(packet,(uint8_t *)arpentry->mac);
-      free(arpentry);
+    if(sr_arpcache_lookup(&(sr->cache),sr_get_ip_dst(packet),mac)) {
+      /* arp cache hit */
+      sr_set_eth_dhost(packet,mac);
     } else {        /* arp cache miss */
-      arpreq = sr_arpcache_queuereq(&(sr->cache),
-          sr_get_ip_dst(packet),
-          packet,len,interface);
+      sr_queue_arp(sr,sr_get_ip_dst(packet),packet,len,interface);
       free(packet);
-      sr_handle_arpreq(sr,arpreq);
       return;
     }
   }
@@ -50,7 +66,8 @@ sr_send_eth (struct sr_instance * sr,
       sr_set_eth_shost(packet,sr_get_arp_sha(packet));
     }
     if(sr_get_arp_op(packet) == htons(arp_op_request)) {
-      sr_set_eth_dhost(packet,BROADCAST);
+      /* broadcast, unless refreshing a known neighbor */
+      sr_set_eth_dhost(packet,sr_get_arp_tha(packet));
       sr_set_eth_shost(packet,sr_get_arp_sha(packet));
     }
   }
@@ -58,6 +75,29 @@ sr_send_eth (struct sr_instance * sr,
   if(dofree) free(packet);
 }
 /* =< end send ethernet >=================================================== */
+/* =< send ethernet via adjacency >========================================= */
+/* Forwarding path: everything but the neighbor's MAC comes from adj. */
+static void
+sr_send_eth_adj (struct sr_instance * sr,
+    uint8_t * packet/* lent */,
+    unsigned int len,
+    struct sr_adj * adj/* lent */)
+{
+  unsigned char mac[ETHER_ADDR_LEN];
+  uint32_t nexthop = sr_adj_nexthop(adj,sr_get_ip_dst(packet));
+
+  sr_set_eth_shost(packet,adj->src);
+  if(!sr_arpcache_lookup_slot(&(sr->cache),nexthop,&(adj->slot),mac)) {
+    sr_queue_arp(sr,nexthop,packet,len,adj->iface->name);
+    free(packet);
+    return;
+  }
+
+  sr_set_eth_dhost(packet,mac);
+  sr_send_packet(sr,packet,len,adj->iface->name);
+  free(packet);
+}
+/* =< end send ethernet via adjacency >===================================== */
 /* =< send ip >============================================================= */
 static void
 sr_send_ip (struct sr_instance * sr,
@@ -66,15 +106,29 @@ sr_send_ip (struct sr_instance * sr,
     char * interface/* lent */)
 {
   struct sr_rt * route;
+  struct sr_adj * adj = NULL;
   struct sr_if * iface = sr_ip_addressed_to_router(sr,packet);
+  struct sr_if * ingress;
+  unsigned int vrf;
+  int rcu;
+
+  /* route, its adjacency, and interface once it points into route, belong
+     to the fib */
+  rcu = sr_rcu_read_lock(&(sr->rcu));
 
   if(iface == NULL) {  /* forward */
-    route = sr_longest_prefix_match(sr,packet);
+    /* in the routing table of the interface the packet came in on */
+    ingress = sr_get_interface(sr,interface);
+    vrf = ingress ? __atomic_load_n(&(ingress->vrf),__ATOMIC_RELAXED) : 0;
+    route = sr_longest_prefix_match(sr,vrf,packet);
     if(route == NULL) {
       sr_send_icmp3(sr,packet,len,interface,icmp3_net);
+      sr_rcu_read_unlock(&(sr->rcu),rcu);
       return;
     }
+    route = sr_ecmp_select(route,packet,len);
     interface = route->interface;
+    adj = sr_rcu_dereference(route->adj);
   } else {
     sr_set_ip_dst(packet,sr_get_ip_src(packet));
     sr_set_ip_src(packet,iface->ip);
@@ -85,7 +139,11 @@ sr_send_ip (struct sr_instance * sr,
   sr_compute_set_ip_sum(packet);
 
   sr_set_eth_type(packet,htons(ethertype_ip));
-  sr_send_eth(sr,packet,len,interface,1);
+  if(adj)
+    sr_send_eth_adj(sr,packet,len,adj);
+  else
+    sr_send_eth(sr,packet,len,interface,1);
+  sr_rcu_read_unlock(&(sr->rcu),rcu);
 }
 /* =< end send ip >========================================================== */
 /* =< send imcp0 >=========================================================== */
@@ -194,6 +252,7 @@ sr_send_arp_reply (struct sr_instance * sr,
 static void
 sr_send_arp_request (struct sr_instance * sr,
     uint32_t ip,
+    unsigned char * tha,
     char * interface)
 {
   struct sr_if * iface = sr_get_interface(sr,interface);
@@ -206,7 +265,7 @@ sr_send_arp_request (struct sr_instance * sr,
   sr_set_arp_op(request,htons(arp_op_request));
   sr_set_arp_sha(request,iface->addr);
   sr_set_arp_sip(request,iface->ip);
-  sr_set_arp_tha(request,BROADCAST);
+  sr_set_arp_tha(request,tha);
   sr_set_arp_tip(request,ip);
   sr_set_eth_type(request,htons(ethertype_arp));
 
@@ -214,14 +273,20 @@ sr_send_arp_request (struct sr_instance * sr,
 }
 /* =< end send arp request >================================================= */
 /* =< send waiting arp reply  >============================================== */
+/* Every packet on req is for the neighbor at req->ip, which answered with
+   mac, whatever its IP destination. */
 static void
 sr_send_waiting_arp_reply (struct sr_instance * sr,
     struct sr_arpreq * req,
-    char * interface)
+    unsigned char * mac)
 {
   struct sr_packet * list = req->packets;
+  struct sr_if * iface;
   while(list) {
-    sr_send_eth(sr,list->buf,list->len,list->iface,0);
+    iface = sr_get_interface(sr,list->iface);
+    sr_set_eth_shost(list->buf,iface->addr);
+    sr_set_eth_dhost(list->buf,mac);
+    sr_send_packet(sr,list->buf,list->len,list->iface);
     list=list->next;
   }
   sr_arpreq_destroy(&(sr->cache),req);
@@ -258,23 +323,21 @@ sr_recv_arp (struct sr_instance * sr,
   char * interface)
 {
   struct sr_if * iface = sr_get_interface(sr, interface);
-  if(sr_get_arp_tip(packet) != iface->ip)
-    return;
-
-  struct sr_arpentry * arpentry;
   struct sr_arpreq * arpreq;
-  arpentry = sr_arpcache_lookup(&(sr->cache),sr_get_ip_src(packet));
-  if(arpentry == NULL) {
+
+  /* every sender on the link is learned or confirmed, whoever it asks,
+     except hosts probing for an address (RFC 5227), which have none yet */
+  if(sr_get_arp_sip(packet) != 0) {
     arpreq = sr_arpcache_insert(&(sr->cache),
         (unsigned char *)sr_get_arp_sha(packet),
-        sr_get_arp_sip(packet));
+        sr_get_arp_sip(packet),
+        iface->index);
     if(arpreq)
-      sr_send_waiting_arp_reply(sr,arpreq,interface);
-  } else {
-    free(arpentry);
+      sr_send_waiting_arp_reply(sr,arpreq,sr_get_arp_sha(packet));
   }
-  arpentry = NULL;
-  arpreq = NULL;
+
+  if(sr_get_arp_tip(packet) != iface->ip)
+    return;
 
 
   if(ntohs(sr_get_arp_op(packet)) == arp_op_request) {
@@ -310,7 +373,7 @@ sr_recv_tcp (struct sr_instance * sr,
       /* FIXME -- */
       if(strcmp(interface,NAT_EXTERNAL_IF) == 0) {
         if(sr_get_tcp_syn(packet) == 1
-            && ntohs(sr_get_tcp_dst(packet)) > 1024)
+            && ntohs(sr_get_tcp_dst(packet)) >= SR_NAT_PORT_MIN)
           return;
       }
       /* -- FIXME */
@@ -401,7 +464,12 @@ void sr_init(struct sr_instance * sr)
 {
   assert(sr);
 
-  sr_arpcache_init(&(sr->cache));
+  if(sr_arpcache_init(&(sr->cache),sr->arp_size,sr->arp_policy) != 0) {
+    fprintf(stderr,"Error setting up the ARP cache\n");
+    exit(1);
+  }
+  if(sr->rt_cached)
+    sr->rt_cache = sr_fib_cache_create();
   sr->nat = NULL;
 
   pthread_attr_init(&(sr->attr));
@@ -410,7 +478,14 @@ void sr_init(struct sr_instance * sr)
   pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
   pthread_t thread;
 
+  /* SIGHUP is taken by the reload thread alone */
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
   pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+  pthread_create(&thread, &(sr->attr), sr_rt_reload_thread, sr);
   memset(BROADCAST,-1,ETHER_ADDR_LEN);
 }
 
@@ -418,23 +493,38 @@ void
 sr_handle_arpreq (struct sr_instance * sr,
     struct sr_arpreq * req)
 {
-  time_t now = time(NULL);
   struct sr_packet * packet;
-  if(difftime(now, req->sent) > 0.1) {
-    if(req->times_sent > 4) { /* unreachable */
-      packet = req->packets;
-      while(packet) {
-        sr_send_icmp3(sr,packet->buf,packet->len,packet->iface,icmp3_host);
-        packet = packet->next;
-      }
-      sr_arpreq_destroy(&(sr->cache),req);
-    } else {
-      sr_send_arp_request(sr,req->ip,req->packets->iface);
-      req->sent = now;
-      req->times_sent += 1;
+  if(req->times_sent > 4) { /* unreachable */
+    /* the icmp sent below may queue packets of its own */
+    sr_arpreq_unqueue(&(sr->cache),req);
+    packet = req->packets;
+    while(packet) {
+      sr_send_icmp3(sr,packet->buf,packet->len,packet->iface,icmp3_host);
+      packet = packet->next;
     }
+    sr_arpreq_destroy(&(sr->cache),req);
+  } else {
+    sr_send_arp_request(sr,req->ip,BROADCAST,req->iface);
+    req->sent = time(NULL);
+    req->times_sent += 1;
+    sr_arpreq_retry(sr,req,SR_ARPREQ_RETRY_MS);
   }
 }
+
+/* Unicast request to the neighbor at mac, on the interface with index
+   ifindex, asking it to confirm it still has ip. */
+void
+sr_send_arp_probe (struct sr_instance * sr,
+    uint32_t ip,
+    unsigned char * mac,
+    unsigned int ifindex)
+{
+  struct sr_if * iface = sr->if_list;
+  while(iface && iface->index != ifindex)
+    iface = iface->next;
+  if(iface)
+    sr_send_arp_request(sr,ip,mac,iface->name);
+}
 /* =< main entry >=========================================================== */
 void
 sr_handlepacket (struct sr_instance * sr,
@@ -14,8 +14,10 @@
 #include <stdio.h>
 
 #include "sr_arpcache.h"
+#include "sr_fib.h"
 #include "sr_nat.h"
 #include "sr_protocol.h"
+#include "sr_rcu.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -58,14 +60,27 @@ struct sr_instance
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
-    struct sr_rt* routing_table; /* routing table */
+    struct sr_vrf vrf[SR_VRF_MAX]; /* routing tables */
+    struct sr_vrf_bind* vrf_binds; /* interfaces not in vrf 0 */
+    struct sr_rcu rcu; /* guards fib against reloads */
+    pthread_mutex_t rt_lock; /* serializes routing table writers */
+    const char* rtable; /* file the routing table was loaded from */
+    const char* rt_image; /* compiled copy of rtable kept by sr_load_rt, or 0 */
+    enum sr_fib_engine fib_engine; /* how fib is compiled */
+    int rt_cached; /* look routes up through rt_cache, -C */
+    struct sr_fib_cache* rt_cache; /* recent fib lookups, or 0 */
+    struct sr_adj* adj_list; /* adjacencies routes are bound to */
     struct sr_arpcache cache;   /* ARP cache */
+    unsigned int arp_size; /* neighbors the ARP cache holds */
+    enum sr_arpq_policy arp_policy; /* for packets awaiting ARP replies */
+    const char* neighbors; /* static neighbors file, pinned on VNSHWINFO */
     struct sr_nat * nat;
     pthread_attr_t attr;
     FILE* logfile;
 };
 
 void sr_handle_arpreq (struct sr_instance * sr,struct sr_arpreq * req);
+void sr_send_arp_probe (struct sr_instance * sr,uint32_t ip,unsigned char * mac,unsigned int ifindex);
 
 /* -- sr_main.c -- */
 int sr_verify_routing_table(struct sr_instance* sr);
@@ -12,33 +12,593 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <fcntl.h>
 
-
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #define __USE_MISC 1 /* force linux to show inet_aton */
 #include <arpa/inet.h>
 
+#include "sr_adj.h"
+#include "sr_fib.h"
 #include "sr_rt.h"
 #include "sr_router.h"
 
+#define SR_RT_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+/* -- sr_load_rt image file, see sr_save_rt_image -- */
+#define SR_RT_IMAGE_MAGIC   "srfibimg"
+#define SR_RT_IMAGE_VERSION 3
+
+/* -- nanoseconds of a file's mtime, so a same-second edit is told apart -- */
+#ifdef _DARWIN_
+#define SR_RT_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define SR_RT_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
+struct sr_rt_image_hdr
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t engine;
+    uint32_t nbinds; /* sr_rt_image_bind records that follow */
+    uint32_t vrfs;   /* bit n is set if a fib image for vrf n follows */
+    uint64_t rtable_size; /* the rtable file the image was compiled from */
+    int64_t  rtable_mtime;
+    int64_t  rtable_mtime_nsec;
+    uint64_t rtable_ino;
+};
+
+struct sr_rt_image_bind
+{
+    char     interface[sr_IFACE_NAMELEN];
+    uint32_t vrf;
+};
+
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_new_rt_entry(..)
+ * Scope: Local
+ *
+ * Allocate a routing table node that is not on any list yet.
  *
  *---------------------------------------------------------------------*/
 
-int sr_load_rt(struct sr_instance* sr,const char* filename)
+static struct sr_rt* sr_new_rt_entry(struct in_addr dest, struct in_addr gw,
+        struct in_addr mask, const char* if_name)
 {
+    struct sr_rt* entry = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+    assert(entry);
+    entry->next = 0;
+    entry->prev = 0;
+    entry->adj = 0;
+    entry->nhg = 0;
+    entry->packets = 0;
+    entry->bytes = 0;
+    entry->arena = 0;
+    entry->dest = dest;
+    entry->gw   = gw;
+    entry->mask = mask;
+    strncpy(entry->interface,if_name,sr_IFACE_NAMELEN);
+    return entry;
+} /* -- sr_new_rt_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_free_rt(..)
+ * Scope: Global
+ *
+ * Free every node of a routing table list. Those sr_fib_load made are
+ * left to the arena of their fib, so free the list before the fib.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_free_rt(struct sr_rt* rt)
+{
+    struct sr_rt* next = 0;
+
+    while(rt)
+    {
+        next = rt->next;
+        if(rt->nhg && !rt->nhg->arena)
+        { free(rt->nhg); }
+        if(!rt->arena)
+        { free(rt); }
+        rt = next;
+    }
+} /* -- sr_free_rt -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_free_vrf_binds(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_free_vrf_binds(struct sr_vrf_bind* bind)
+{
+    struct sr_vrf_bind* next = 0;
+
+    while(bind)
+    {
+        next = bind->next;
+        free(bind);
+        bind = next;
+    }
+} /* -- sr_free_vrf_binds -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_read_vrf_line(..)
+ * Scope: Local
+ *
+ * Parse "vrf <n> [iface ...]": routes on the lines that follow go in
+ * table n, and packets arriving on the listed interfaces are routed in
+ * it. Returns 0 on success, -1 on error.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_read_vrf_line(char* line, unsigned int* vrf,
+        struct sr_vrf_bind** binds)
+{
+    struct sr_vrf_bind* bind = 0;
+    char* token = 0;
+    char* end = 0;
+    unsigned long n;
+
+    strtok(line," \t\r\n"); /* -- "vrf" -- */
+    token = strtok(0," \t\r\n");
+    if(token == 0)
+    {
+        fprintf(stderr,"Error loading routing table, vrf without a number\n");
+        return -1;
+    }
+    n = strtoul(token,&end,10);
+    if(*end != 0 || n >= SR_VRF_MAX)
+    {
+        fprintf(stderr,
+                "Error loading routing table, vrf %s is not 0 - %d\n",
+                token,SR_VRF_MAX - 1);
+        return -1;
+    }
+    *vrf = n;
+
+    while((token = strtok(0," \t\r\n")) != 0)
+    {
+        for(bind = *binds; bind; bind = bind->next)
+        {
+            if(strncmp(bind->interface,token,sr_IFACE_NAMELEN) == 0)
+            {
+                fprintf(stderr,
+                        "Error loading routing table, %s is in two vrfs\n",
+                        token);
+                return -1;
+            }
+        }
+        bind = (struct sr_vrf_bind*)malloc(sizeof(struct sr_vrf_bind));
+        assert(bind);
+        strncpy(bind->interface,token,sr_IFACE_NAMELEN);
+        bind->interface[sr_IFACE_NAMELEN - 1] = 0;
+        bind->vrf = *vrf;
+        bind->next = *binds;
+        *binds = bind;
+    }
+
+    return 0;
+} /* -- sr_read_vrf_line -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_bind_interfaces(..)
+ * Scope: Local
+ *
+ * Point every known interface at the vrf the rtable file bound it to.
+ * Call with rt_lock held.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_bind_interfaces(struct sr_instance* sr)
+{
+    struct sr_if* if_walker = 0;
+    struct sr_vrf_bind* bind = 0;
+
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+    {
+        for(bind = sr->vrf_binds; bind; bind = bind->next)
+        {
+            if(strncmp(bind->interface,if_walker->name,sr_IFACE_NAMELEN) == 0)
+            { break; }
+        }
+        __atomic_store_n(&(if_walker->vrf),bind ? bind->vrf : 0,
+                __ATOMIC_RELAXED);
+    }
+} /* -- sr_bind_interfaces -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_retire_rt(..)
+ * Scope: Local
+ *
+ * Unlink route, and the rest of the equal cost group it leads, from
+ * table and hand them to the next grace period. Call with rt_lock held
+ * once the fib no longer leads to route.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_retire_rt(struct sr_instance* sr, struct sr_vrf* table,
+        struct sr_rt* route)
+{
+    struct sr_rt* nh = 0;
+    unsigned int n = route->nhg ? route->nhg->n : 1;
+    unsigned int i;
+
+    for(i = 0; i < n; i++)
+    {
+        nh = route->nhg ? route->nhg->nh[i] : route;
+        if(nh->prev)
+        { nh->prev->next = nh->next; }
+        else
+        { table->routing_table = nh->next; }
+        if(nh->next)
+        { nh->next->prev = nh->prev; }
+        sr_adj_unbind(sr,nh);
+        if(!nh->arena)
+        { sr_rcu_defer_free(&(sr->rcu),nh); }
+    }
+    if(route->nhg && !route->nhg->arena)
+    { sr_rcu_defer_free(&(sr->rcu),route->nhg); }
+} /* -- sr_retire_rt -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_next_token(..)
+ * Scope: Local
+ *
+ * Find the next whitespace separated token in [p,eol). Returns its start
+ * and sets *end past it; the two are equal if there is none.
+ *
+ *---------------------------------------------------------------------*/
+
+static const char* sr_next_token(const char* p, const char* eol,
+        const char** end)
+{
+    while(p < eol && SR_RT_SPACE(*p))
+    { p++; }
+    *end = p;
+    while(*end < eol && !SR_RT_SPACE(**end))
+    { (*end)++; }
+    return p;
+} /* -- sr_next_token -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_parse_ip(..)
+ * Scope: Local
+ *
+ * Convert the address in [s,end), which need not be terminated. Plain
+ * dotted quads are converted in place; anything else inet_aton takes
+ * (hex, octal, fewer parts) goes through inet_aton. Returns nonzero on
+ * success, like inet_aton.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_parse_ip(const char* s, const char* end, struct in_addr* addr)
+{
+    char buf[32];
+    const char* p = s;
+    const char* first = 0;
+    uint32_t ip = 0;
+    unsigned int octet;
+    unsigned int digits;
+    unsigned int parts = 0;
+
+    while(1)
+    {
+        octet = 0;
+        first = p;
+        for(digits = 0; p < end && *p >= '0' && *p <= '9' && digits < 4;
+                digits++, p++)
+        { octet = octet * 10 + (*p - '0'); }
+        if(digits == 0 || digits == 4 || octet > 255
+                || (digits > 1 && *first == '0'))
+        { break; } /* -- leading 0 is octal to inet_aton -- */
+        ip = (ip << 8) | octet;
+        if(++parts == 4)
+        {
+            if(p != end)
+            { break; }
+            addr->s_addr = htonl(ip);
+            return 1;
+        }
+        if(p == end || *p != '.')
+        { break; }
+        p++;
+    }
+
+    if(end - s >= (long)sizeof(buf))
+    { return 0; }
+    memcpy(buf,s,end - s);
+    buf[end - s] = 0;
+    return inet_aton(buf,addr);
+} /* -- sr_parse_ip -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_install_rt(..)
+ * Scope: Local
+ *
+ * Publish freshly built tables and interface bindings in place of the
+ * live ones, then free the old ones once no reader can still be using
+ * them. Takes rt_lock.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_install_rt(struct sr_instance* sr, struct sr_rt** routes,
+        struct sr_fib** fib, struct sr_vrf_bind* binds)
+{
+    struct sr_vrf old[SR_VRF_MAX];
+    struct sr_vrf_bind* old_binds = 0;
+    struct sr_rt* rt_walker = 0;
+    unsigned int i;
+
+    pthread_mutex_lock(&(sr->rt_lock));
+    printf("Loading routing table from server, clear local routing table.\n");
+    for(i = 0; i < SR_VRF_MAX; i++)
+    {
+        for(rt_walker = routes[i]; rt_walker; rt_walker = rt_walker->next)
+        { sr_adj_bind(sr,rt_walker); }
+        old[i] = sr->vrf[i];
+        sr->vrf[i].routing_table = routes[i];
+        sr_rcu_assign_pointer(sr->vrf[i].fib,fib[i]);
+        for(rt_walker = old[i].routing_table; rt_walker;
+                rt_walker = rt_walker->next)
+        { sr_adj_unbind(sr,rt_walker); }
+    }
+    old_binds = sr->vrf_binds;
+    sr->vrf_binds = binds;
+    sr_bind_interfaces(sr);
+
+    /* -- also retires anything single route updates left behind -- */
+    sr_rcu_reclaim(&(sr->rcu));
+    for(i = 0; i < SR_VRF_MAX; i++)
+    {
+        sr_free_rt(old[i].routing_table);
+        sr_fib_destroy(old[i].fib);
+    }
+    sr_free_vrf_binds(old_binds);
+    pthread_mutex_unlock(&(sr->rt_lock));
+} /* -- sr_install_rt -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_save_rt_image(..)
+ * Scope: Local
+ *
+ * Write the tables just compiled from the rtable file described by st
+ * to sr->rt_image, for sr_load_rt_image to pick up on the next start.
+ * The image is written beside the old one and renamed over it, so a
+ * crash halfway leaves the old one intact.
+ *
+ *---------------------------------------------------------------------*/
+
+static void sr_save_rt_image(struct sr_instance* sr, const struct stat* st,
+        struct sr_fib** fib, struct sr_vrf_bind* binds)
+{
+    struct sr_rt_image_hdr hdr;
+    struct sr_rt_image_bind rec;
+    struct sr_vrf_bind* bind = 0;
+    char tmp[BUFSIZ];
     FILE* fp;
+    unsigned int i;
+    int error = 0;
+
+    if(strlen(sr->rt_image) + 5 > sizeof(tmp))
+    {
+        fprintf(stderr,"Routing table image path too long: %s\n",
+                sr->rt_image);
+        return;
+    }
+    sprintf(tmp,"%s.tmp",sr->rt_image);
+
+    memset(&hdr,0,sizeof(hdr));
+    memcpy(hdr.magic,SR_RT_IMAGE_MAGIC,sizeof(hdr.magic));
+    hdr.version = SR_RT_IMAGE_VERSION;
+    hdr.engine = sr->fib_engine;
+    hdr.rtable_size = st->st_size;
+    hdr.rtable_mtime = st->st_mtime;
+    hdr.rtable_mtime_nsec = SR_RT_MTIME_NSEC(st);
+    hdr.rtable_ino = st->st_ino;
+    for(bind = binds; bind; bind = bind->next)
+    { hdr.nbinds++; }
+    for(i = 0; i < SR_VRF_MAX; i++)
+    {
+        if(fib[i])
+        { hdr.vrfs |= 1U << i; }
+    }
+
+    fp = fopen(tmp,"wb");
+    if(fp == 0)
+    {
+        perror("fopen");
+        return;
+    }
+
+    if(fwrite(&hdr,sizeof(hdr),1,fp) != 1)
+    { error = 1; }
+    for(bind = binds; bind && !error; bind = bind->next)
+    {
+        memset(&rec,0,sizeof(rec));
+        strncpy(rec.interface,bind->interface,sr_IFACE_NAMELEN);
+        rec.vrf = bind->vrf;
+        if(fwrite(&rec,sizeof(rec),1,fp) != 1)
+        { error = 1; }
+    }
+    for(i = 0; i < SR_VRF_MAX && !error; i++)
+    {
+        if(fib[i] && sr_fib_save(fib[i],fp) != 0)
+        { error = 1; }
+    }
+
+    if(fclose(fp) != 0 || error || rename(tmp,sr->rt_image) != 0)
+    {
+        fprintf(stderr,"Error writing routing table image %s\n",
+                sr->rt_image);
+        unlink(tmp);
+    }
+} /* -- sr_save_rt_image -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt_image(..)
+ * Scope: Local
+ *
+ * Load the tables from sr->rt_image instead of compiling them again, if
+ * it was saved from the rtable file described by st, as it is now, and
+ * for the lookup engine in use. Returns 0 if the image was installed,
+ * -1 if the rtable file has to be read.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_load_rt_image(struct sr_instance* sr, const struct stat* st)
+{
+    struct sr_rt_image_hdr hdr;
+    struct sr_rt_image_bind rec;
+    struct sr_rt* routes[SR_VRF_MAX];
+    struct sr_fib* fib[SR_VRF_MAX];
+    struct sr_vrf_bind* binds = 0;
+    struct sr_vrf_bind* bind = 0;
+    struct stat image_st;
+    const unsigned char* map = 0;
+    const unsigned char* pos = 0;
+    const unsigned char* end = 0;
+    unsigned int i;
+    int error = 0;
+    int fd;
+
+    fd = open(sr->rt_image,O_RDONLY);
+    if(fd < 0)
+    { return -1; } /* -- none saved yet -- */
+    if(fstat(fd,&image_st) != 0 || image_st.st_size < (off_t)sizeof(hdr))
+    {
+        close(fd);
+        return -1;
+    }
+    map = mmap(0,image_st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(map == MAP_FAILED)
+    { return -1; }
+    pos = map;
+    end = map + image_st.st_size;
+
+    memcpy(&hdr,pos,sizeof(hdr));
+    pos += sizeof(hdr);
+    if(memcmp(hdr.magic,SR_RT_IMAGE_MAGIC,sizeof(hdr.magic)) != 0
+            || hdr.version != SR_RT_IMAGE_VERSION
+            || hdr.engine != sr->fib_engine
+            || hdr.rtable_size != (uint64_t)st->st_size
+            || hdr.rtable_mtime != (int64_t)st->st_mtime
+            || hdr.rtable_mtime_nsec != (int64_t)SR_RT_MTIME_NSEC(st)
+            || hdr.rtable_ino != (uint64_t)st->st_ino)
+    {
+        printf("Routing table image %s is out of date\n",sr->rt_image);
+        munmap((void*)map,image_st.st_size);
+        return -1;
+    }
+
+    for(i = 0; i < SR_VRF_MAX; i++)
+    {
+        routes[i] = 0;
+        fib[i] = 0;
+    }
+
+    if(hdr.nbinds > (size_t)(end - pos) / sizeof(rec))
+    { error = 1; }
+    for(i = 0; i < hdr.nbinds && !error; i++)
+    {
+        memcpy(&rec,pos,sizeof(rec));
+        pos += sizeof(rec);
+        if(rec.vrf >= SR_VRF_MAX)
+        {
+            error = 1;
+            break;
+        }
+        bind = (struct sr_vrf_bind*)malloc(sizeof(struct sr_vrf_bind));
+        assert(bind);
+        memcpy(bind->interface,rec.interface,sr_IFACE_NAMELEN);
+        bind->interface[sr_IFACE_NAMELEN - 1] = 0;
+        bind->vrf = rec.vrf;
+        bind->next = binds;
+        binds = bind;
+    }
+    for(i = 0; i < SR_VRF_MAX && !error; i++)
+    {
+        if((hdr.vrfs & (1U << i)) == 0)
+        { continue; }
+        fib[i] = sr_fib_load(&pos,end,sr->fib_engine,&(routes[i]));
+        if(fib[i] == 0)
+        { error = 1; }
+    }
+    if(pos != end || hdr.vrfs == 0)
+    { error = 1; }
+
+    munmap((void*)map,image_st.st_size);
+
+    if(error)
+    {
+        fprintf(stderr,"Routing table image %s is damaged\n",sr->rt_image);
+        for(i = 0; i < SR_VRF_MAX; i++)
+        {
+            sr_free_rt(routes[i]);
+            sr_fib_destroy(fib[i]);
+        }
+        sr_free_vrf_binds(binds);
+        return -1;
+    }
+
+    printf("Routing table loaded from image %s\n",sr->rt_image);
+    sr_install_rt(sr,routes,fib,binds);
+    return 0;
+} /* -- sr_load_rt_image -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt(..)
+ * Scope: Global
+ *
+ * Read the routing tables from filename and compile them. Routes go in
+ * vrf 0 until a "vrf <n> [iface ...]" line switches tables; see
+ * sr_read_vrf_line. Several lines for one prefix in a table are equal
+ * cost next hops for it. The new tables are built off to the side and
+ * published with one pointer swap each, so it is safe to call while
+ * packets are being forwarded. The old tables are freed once no reader
+ * can still be using them.
+ *
+ * The file is mapped and tokenized in place rather than read a line at
+ * a time. If sr->rt_image is set, the compiled tables are also saved
+ * there, and loaded from there instead as long as filename is unchanged.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt(struct sr_instance* sr,const char* filename)
+{
     char  line[BUFSIZ];
-    char  dest[32];
-    char  gw[32];
-    char  mask[32];
-    char  iface[32];
+    char  iface[sr_IFACE_NAMELEN];
+    const char* text = 0;
+    const char* text_end = 0;
+    const char* start = 0;
+    const char* eol = 0;
+    const char* p = 0;
+    const char* tok[4];
+    const char* tok_end[4];
     struct in_addr dest_addr;
     struct in_addr gw_addr;
     struct in_addr mask_addr;
-    int clear_routing_table = 0;
+    struct sr_rt* routes[SR_VRF_MAX];
+    struct sr_rt** tail[SR_VRF_MAX];
+    struct sr_rt* last[SR_VRF_MAX];
+    struct sr_fib* fib[SR_VRF_MAX];
+    struct sr_vrf_bind* binds = 0;
+    struct stat st;
+    unsigned int vrf = 0;
+    unsigned int nroutes = 0;
+    unsigned int ntok;
+    unsigned int i;
+    size_t len;
+    int error = 0;
+    int fd;
 
     /* -- REQUIRES -- */
     assert(filename);
@@ -48,88 +608,299 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
         return -1;
     }
 
-    fp = fopen(filename,"r");
+    fd = open(filename,O_RDONLY);
+    if(fd < 0 || fstat(fd,&st) != 0)
+    {
+        perror("open");
+        if(fd >= 0)
+        { close(fd); }
+        return -1;
+    }
+
+    if(sr->rt_image && sr_load_rt_image(sr,&st) == 0)
+    {
+        close(fd);
+        return 0;
+    }
 
-    while( fgets(line,BUFSIZ,fp) != 0)
+    if(st.st_size > 0)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
-            return -1; 
+        text = mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if(text == MAP_FAILED)
+        {
+            perror("mmap");
+            close(fd);
+            return -1;
         }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
+        madvise((void*)text,st.st_size,MADV_SEQUENTIAL);
+        text_end = text + st.st_size;
+    }
+    close(fd);
+
+    for(i = 0; i < SR_VRF_MAX; i++)
+    {
+        routes[i] = 0;
+        tail[i] = &(routes[i]);
+        last[i] = 0;
+    }
+
+    for(start = text; start < text_end && !error;
+            start = eol < text_end ? eol + 1 : text_end)
+    {
+        eol = memchr(start,'\n',text_end - start);
+        if(eol == 0)
+        { eol = text_end; }
+
+        p = start;
+        for(ntok = 0; ntok < 4; ntok++)
+        {
+            tok[ntok] = sr_next_token(p,eol,&(tok_end[ntok]));
+            if(tok[ntok] == tok_end[ntok])
+            { break; }
+            p = tok_end[ntok];
         }
-        if(inet_aton(mask,&mask_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
+
+        if(ntok > 0 && tok_end[0] - tok[0] == 3
+                && memcmp(tok[0],"vrf",3) == 0)
+        {
+            len = eol - start < (long)sizeof(line) ? (size_t)(eol - start)
+                : sizeof(line) - 1;
+            memcpy(line,start,len);
+            line[len] = 0;
+            if(sr_read_vrf_line(line,&vrf,&binds) != 0)
+            { error = 1; }
+            continue;
         }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
+        if(ntok != 4)
+        { continue; } /* -- blank or short line -- */
+
+        for(i = 0; i < 3; i++)
+        {
+            if(sr_parse_ip(tok[i],tok_end[i],
+                        i == 0 ? &dest_addr : i == 1 ? &gw_addr : &mask_addr)
+                    == 0)
+            {
+                fprintf(stderr,
+                        "Error loading routing table, cannot convert %.*s to valid IP\n",
+                        (int)(tok_end[i] - tok[i]),tok[i]);
+                error = 1;
+                break;
+            }
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
-    } /* -- while -- */
+        if(error)
+        { break; }
+
+        len = tok_end[3] - tok[3];
+        if(len >= sizeof(iface))
+        { len = sizeof(iface) - 1; }
+        memcpy(iface,tok[3],len);
+        iface[len] = 0;
+
+        *tail[vrf] = sr_new_rt_entry(dest_addr,gw_addr,mask_addr,iface);
+        (*tail[vrf])->prev = last[vrf];
+        last[vrf] = *tail[vrf];
+        tail[vrf] = &((*tail[vrf])->next);
+        nroutes++;
+    } /* -- for -- */
+
+    if(text)
+    { munmap((void*)text,st.st_size); }
+
+    if(error || nroutes == 0)
+    {
+        /* -- the tables in use stay -- */
+        for(i = 0; i < SR_VRF_MAX; i++)
+        { sr_free_rt(routes[i]); }
+        sr_free_vrf_binds(binds);
+        return error ? -1 : 0;
+    }
+
+    /* -- compile each list for sr_longest_prefix_match -- */
+    for(i = 0; i < SR_VRF_MAX; i++)
+    { fib[i] = routes[i] ? sr_fib_build(routes[i],sr->fib_engine) : 0; }
+
+    if(sr->rt_image)
+    { sr_save_rt_image(sr,&st,fib,binds); }
+
+    sr_install_rt(sr,routes,fib,binds);
 
     return 0; /* -- success -- */
 } /* -- sr_load_rt -- */
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_rt_reload_thread(..)
+ * Scope: Global
+ *
+ * Reload the routing table from the file it was last loaded from each
+ * time the router gets SIGHUP. Every other thread must block SIGHUP.
+ *
+ *---------------------------------------------------------------------*/
+
+void* sr_rt_reload_thread(void* sr_ptr)
+{
+    struct sr_instance* sr = (struct sr_instance*)sr_ptr;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set,SIGHUP);
+
+    while(1)
+    {
+        if(sigwait(&set,&sig) != 0)
+        { continue; }
+
+        printf("SIGHUP, reloading routing table from %s\n",sr->rtable);
+        if(sr_load_rt(sr,sr->rtable) != 0)
+        {
+            fprintf(stderr,"Error reloading routing table, keeping old one\n");
+            continue;
+        }
+        pthread_mutex_lock(&(sr->rt_lock));
+        sr_print_routing_table(sr);
+        pthread_mutex_unlock(&(sr->rt_lock));
+    }
+
+    return 0;
+} /* -- sr_rt_reload_thread -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_add_rt_entry(..)
+ * Scope: Global
+ *
+ * Add a single route to the live table vrf. The fib is patched in place,
+ * in time proportional to the prefix length, rather than rebuilt. A route
+ * for a prefix already in the table replaces it, with all its equal cost
+ * next hops, unless ecmp is set: then it joins them as another one.
+ * Whatever the update unlinks is freed by the next sr_rt_commit.
  *
  *---------------------------------------------------------------------*/
 
 void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
-struct in_addr gw, struct in_addr mask,char* if_name)
+struct in_addr gw, struct in_addr mask,char* if_name, unsigned int vrf,
+int ecmp)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_vrf* table = 0;
+    struct sr_rt* entry = 0;
+    struct sr_rt* replaced = 0;
 
     /* -- REQUIRES -- */
     assert(if_name);
     assert(sr);
+    assert(vrf < SR_VRF_MAX);
 
-    /* -- empty list special case -- */
-    if(sr->routing_table == 0)
-    {
-        sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-        assert(sr->routing_table);
-        sr->routing_table->next = 0;
-        sr->routing_table->dest = dest;
-        sr->routing_table->gw   = gw;
-        sr->routing_table->mask = mask;
-        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+    table = &(sr->vrf[vrf]);
+    entry = sr_new_rt_entry(dest,gw,mask,if_name);
 
-        return;
-    }
+    pthread_mutex_lock(&(sr->rt_lock));
+
+    /* -- no table loaded yet, start from an empty fib -- */
+    if(table->fib == 0)
+    { sr_rcu_assign_pointer(table->fib,sr_fib_build(0,sr->fib_engine)); }
+
+    sr_adj_bind(sr,entry);
+
+    /* -- new routes go on the front, order means nothing to the fib -- */
+    entry->next = table->routing_table;
+    if(table->routing_table)
+    { table->routing_table->prev = entry; }
+    table->routing_table = entry;
+
+    if(ecmp)
+    { sr_fib_append(table->fib,entry,&(sr->rcu)); }
+    else
+    { replaced = sr_fib_insert(table->fib,entry,&(sr->rcu)); }
+    if(replaced)
+    { sr_retire_rt(sr,table,replaced); }
+
+    pthread_mutex_unlock(&(sr->rt_lock));
+
+} /* -- sr_add_rt_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_del_rt_entry(..)
+ * Scope: Global
+ *
+ * Withdraw the route for dest/mask, with all its equal cost next hops,
+ * from the live table vrf. Returns 0 on success, -1 if there is no such
+ * route.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_del_rt_entry(struct sr_instance* sr, struct in_addr dest,
+        struct in_addr mask, unsigned int vrf)
+{
+    struct sr_vrf* table = 0;
+    struct sr_rt* route = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(vrf < SR_VRF_MAX);
+
+    table = &(sr->vrf[vrf]);
+
+    pthread_mutex_lock(&(sr->rt_lock));
+
+    if(table->fib)
+    { route = sr_fib_remove(table->fib,dest,mask,&(sr->rcu)); }
+
+    if(route)
+    { sr_retire_rt(sr,table,route); }
+
+    pthread_mutex_unlock(&(sr->rt_lock));
+
+    return route ? 0 : -1;
+} /* -- sr_del_rt_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_commit(..)
+ * Scope: Global
+ *
+ * Finish a batch of sr_add_rt_entry/sr_del_rt_entry calls: wait out one
+ * grace period, free what the batch unlinked and let the fib reuse the
+ * route slots it released.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rt_commit(struct sr_instance* sr)
+{
+    unsigned int i;
 
-    /* -- find the end of the list -- */
-    rt_walker = sr->routing_table;
-    while(rt_walker->next){
-      rt_walker = rt_walker->next; 
+    pthread_mutex_lock(&(sr->rt_lock));
+    sr_rcu_reclaim(&(sr->rcu));
+    for(i = 0; i < SR_VRF_MAX; i++)
+    {
+        if(sr->vrf[i].fib)
+        { sr_fib_recycle(sr->vrf[i].fib); }
     }
+    pthread_mutex_unlock(&(sr->rt_lock));
+} /* -- sr_rt_commit -- */
 
-    rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-    assert(rt_walker->next);
-    rt_walker = rt_walker->next;
+/*---------------------------------------------------------------------
+ * Method: sr_rt_bind(..)
+ * Scope: Global
+ *
+ * Bind every route in the live tables to its adjacency, and every
+ * interface to its vrf. Routes and bindings loaded before the server
+ * told us about our interfaces wait for this call.
+ *
+ *---------------------------------------------------------------------*/
 
-    rt_walker->next = 0;
-    rt_walker->dest = dest;
-    rt_walker->gw   = gw;
-    rt_walker->mask = mask;
-    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+void sr_rt_bind(struct sr_instance* sr)
+{
+    struct sr_rt* rt_walker = 0;
+    unsigned int i;
 
-} /* -- sr_add_entry -- */
+    pthread_mutex_lock(&(sr->rt_lock));
+    for(i = 0; i < SR_VRF_MAX; i++)
+    {
+        for(rt_walker = sr->vrf[i].routing_table; rt_walker;
+                rt_walker = rt_walker->next)
+        { sr_adj_bind(sr,rt_walker); }
+    }
+    sr_bind_interfaces(sr);
+    pthread_mutex_unlock(&(sr->rt_lock));
+} /* -- sr_rt_bind -- */
 
 /*---------------------------------------------------------------------
  * Method:
@@ -139,24 +910,37 @@ struct in_addr gw, struct in_addr mask,char* if_name)
 void sr_print_routing_table(struct sr_instance* sr)
 {
     struct sr_rt* rt_walker = 0;
+    struct sr_vrf_bind* bind = 0;
+    unsigned int i;
+    int empty = 1;
 
-    if(sr->routing_table == 0)
+    for(i = 0; i < SR_VRF_MAX; i++)
     {
-        printf(" *warning* Routing table empty \n");
-        return;
-    }
+        if(sr->vrf[i].routing_table == 0)
+        { continue; }
+        empty = 0;
 
-    printf("Destination\tGateway\t\tMask\tIface\n");
+        if(i != 0)
+        {
+            printf("VRF %u:",i);
+            for(bind = sr->vrf_binds; bind; bind = bind->next)
+            {
+                if(bind->vrf == i)
+                { printf(" %s",bind->interface); }
+            }
+            printf("\n");
+        }
 
-    rt_walker = sr->routing_table;
-    
-    sr_print_routing_entry(rt_walker);
-    while(rt_walker->next)
-    {
-        rt_walker = rt_walker->next; 
-        sr_print_routing_entry(rt_walker);
+        printf("Destination\tGateway\t\tMask\tIface\n");
+
+        for(rt_walker = sr->vrf[i].routing_table; rt_walker;
+                rt_walker = rt_walker->next)
+        { sr_print_routing_entry(rt_walker); }
     }
 
+    if(empty)
+    { printf(" *warning* Routing table empty \n"); }
+
 } /* -- sr_print_routing_table -- */
 
 /*---------------------------------------------------------------------
@@ -20,6 +20,12 @@
 
 #include "sr_if.h"
 
+#define SR_VRF_MAX 16 /* routing tables, 0 is the default */
+
+struct sr_adj;
+struct sr_fib;
+struct sr_nhg;
+
 /* ----------------------------------------------------------------------------
  * struct sr_rt
  *
@@ -34,12 +40,65 @@ struct sr_rt
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
     struct sr_rt* next;
+    struct sr_rt* prev; /* so single routes unlink in O(1) */
+    struct sr_adj* adj; /* egress adjacency, 0 until interfaces are known */
+    struct sr_nhg* nhg; /* next hops for dest/mask if this route leads an
+                           equal cost group, else 0 */
+    unsigned long packets; /* forwarded through this next hop */
+    unsigned long bytes;
+    int arena; /* made by sr_fib_load in its fib's arena, which frees it */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_nhg
+ *
+ * Equal cost next hops for one prefix: every route in a table for the
+ * same dest/mask. The fib holds the first, nh[0], which owns the group;
+ * each flow is sent through one member picked by hashing its 5-tuple.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_nhg
+{
+    unsigned int n;
+    unsigned int cap;
+    int arena; /* made by sr_fib_load, as for struct sr_rt */
+    struct sr_rt* nh[1]; /* cap entries */
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_vrf
+ *
+ * One of several isolated routing tables. A packet is routed in the table
+ * its ingress interface is bound to, 0 unless the rtable file says
+ * otherwise.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_vrf
+{
+    struct sr_rt* routing_table; /* routes, writers only */
+    struct sr_fib* fib; /* routing_table compiled for lookups, rcu */
+};
+
+/* interface binding from a "vrf" line of the rtable file */
+struct sr_vrf_bind
+{
+    char   interface[sr_IFACE_NAMELEN];
+    unsigned int vrf;
+    struct sr_vrf_bind* next;
 };
 
 
 int sr_load_rt(struct sr_instance*,const char*);
+void sr_free_rt(struct sr_rt*);
+void* sr_rt_reload_thread(void*);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
-                  struct in_addr, char*);
+                  struct in_addr, char*, unsigned int, int);
+int sr_del_rt_entry(struct sr_instance*, struct in_addr, struct in_addr,
+                  unsigned int);
+void sr_rt_commit(struct sr_instance*);
+void sr_rt_bind(struct sr_instance*);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
 
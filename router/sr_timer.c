@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sr_timer.h"
+
+#define SR_TIMER_ROOT_MASK ((1 << SR_TIMER_ROOT_BITS) - 1)
+#define SR_TIMER_LVL_MASK  ((1 << SR_TIMER_LVL_BITS) - 1)
+#define SR_TIMER_SPAN(n)   ((uint64_t)1 << (SR_TIMER_ROOT_BITS + (n) * SR_TIMER_LVL_BITS))
+
+/* ---< slots >-------------------------------------------------------------- */
+static void
+sr_timer_link (struct sr_timer ** slot, struct sr_timer * timer)
+{
+  timer->next = *slot;
+  if(timer->next)
+    timer->next->pprev = &(timer->next);
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+/* Puts timer in the slot of the lowest wheel whose span covers it. Overdue
+   timers go in the slot run next, those past the top wheel's span are cut
+   short to it. */
+static void
+sr_timer_place (struct sr_timer_wheel * wheel, struct sr_timer * timer)
+{
+  uint64_t delta;
+  int n;
+
+  if(timer->expires < wheel->clk)
+    timer->expires = wheel->clk;
+  delta = timer->expires - wheel->clk;
+
+  if(delta < SR_TIMER_SPAN(0)) {
+    sr_timer_link(&(wheel->root[timer->expires & SR_TIMER_ROOT_MASK]),timer);
+    return;
+  }
+
+  if(delta >= SR_TIMER_SPAN(SR_TIMER_LEVELS))
+    timer->expires = wheel->clk + SR_TIMER_SPAN(SR_TIMER_LEVELS) - 1;
+  for(n = 0; n < SR_TIMER_LEVELS - 1; n++) {
+    if(delta < SR_TIMER_SPAN(n + 1))
+      break;
+  }
+  sr_timer_link(&(wheel->lvl[n][(timer->expires
+        >> (SR_TIMER_ROOT_BITS + n * SR_TIMER_LVL_BITS)) & SR_TIMER_LVL_MASK]),
+      timer);
+}
+
+/* Spreads the timers of a higher wheel's slot over the wheels below. */
+static void
+sr_timer_cascade (struct sr_timer_wheel * wheel, struct sr_timer ** slot)
+{
+  struct sr_timer * timer = *slot;
+  struct sr_timer * next;
+
+  *slot = 0;
+  for(; timer; timer = next) {
+    next = timer->next;
+    sr_timer_place(wheel,timer);
+  }
+}
+/* ---< clock >-------------------------------------------------------------- */
+uint64_t
+sr_timer_clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * (1000 / SR_TIMER_TICK_MS)
+    + ts.tv_nsec / (SR_TIMER_TICK_MS * 1000000L);
+}
+/* ---< timers >------------------------------------------------------------- */
+void
+sr_timer_wheel_init (struct sr_timer_wheel * wheel)
+{
+  memset(wheel,0,sizeof(*wheel));
+  wheel->clk = sr_timer_clock();
+}
+
+void
+sr_timer_init (struct sr_timer * timer, sr_timer_fn fn, void * arg)
+{
+  timer->next = 0;
+  timer->pprev = 0;
+  timer->expires = 0;
+  timer->fn = fn;
+  timer->arg = arg;
+}
+
+void
+sr_timer_add (struct sr_timer_wheel * wheel, struct sr_timer * timer,
+    unsigned long ms)
+{
+  uint64_t ticks = (ms + SR_TIMER_TICK_MS - 1) / SR_TIMER_TICK_MS;
+
+  /* -- counted from the last tick run, which callbacks run in -- */
+  sr_timer_del(timer);
+  timer->expires = ticks ? wheel->clk - 1 + ticks : wheel->clk;
+  sr_timer_place(wheel,timer);
+}
+
+void
+sr_timer_del (struct sr_timer * timer)
+{
+  if(!timer->pprev)
+    return;
+  *(timer->pprev) = timer->next;
+  if(timer->next)
+    timer->next->pprev = timer->pprev;
+  timer->next = 0;
+  timer->pprev = 0;
+}
+/* ---< running >------------------------------------------------------------ */
+void
+sr_timer_run (struct sr_timer_wheel * wheel, uint64_t now)
+{
+  struct sr_timer * work;
+  struct sr_timer * timer;
+  unsigned int idx, slot;
+  int n;
+
+  while(wheel->clk <= now) {
+    idx = wheel->clk & SR_TIMER_ROOT_MASK;
+
+    /* -- each time a wheel wraps, the one above moves on a slot -- */
+    if(idx == 0) {
+      for(n = 0; n < SR_TIMER_LEVELS; n++) {
+        slot = (wheel->clk >> (SR_TIMER_ROOT_BITS + n * SR_TIMER_LVL_BITS))
+          & SR_TIMER_LVL_MASK;
+        sr_timer_cascade(wheel,&(wheel->lvl[n][slot]));
+        if(slot)
+          break;
+      }
+    }
+
+    /* -- detached first, so callbacks may re-arm into this slot -- */
+    work = wheel->root[idx];
+    wheel->root[idx] = 0;
+    if(work)
+      work->pprev = &work;
+    wheel->clk++;
+
+    while((timer = work)) {
+      sr_timer_del(timer);
+      timer->fn(timer,timer->arg);
+    }
+  }
+}
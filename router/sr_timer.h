@@ -0,0 +1,70 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_timer.h
+ *
+ * Description:
+ *
+ * Hierarchical timer wheel with SR_TIMER_TICK_MS resolution. Timers are
+ * embedded in the objects they time out and cost O(1) to arm, re-arm and
+ * cancel. The root wheel has a slot per tick for the next 256 ticks; each
+ * of the four wheels above covers 64 times the span of the one below, and
+ * a slot of theirs is spread over the wheel below once time reaches it.
+ * Advancing a tick thus only touches the timers that fire and, every 256
+ * ticks, one slot of a higher wheel.
+ *
+ * A wheel takes no lock. Its owner serializes sr_timer_add, sr_timer_del
+ * and sr_timer_run, typically under the lock of the data being timed, and
+ * callbacks run with that lock held. A callback may re-arm or cancel any
+ * timer on the wheel, including its own.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_TIMER_H
+#define SR_TIMER_H
+
+#include <stdint.h>
+
+#define SR_TIMER_TICK_MS   10
+#define SR_TIMER_ROOT_BITS 8
+#define SR_TIMER_LVL_BITS  6
+#define SR_TIMER_LEVELS    4
+
+struct sr_timer;
+
+typedef void (*sr_timer_fn)(struct sr_timer * timer, void * arg);
+
+struct sr_timer {
+  struct sr_timer * next;        /* in its slot */
+  struct sr_timer ** pprev;      /* what points at it, 0 when not armed */
+  uint64_t expires;              /* tick it fires at */
+  sr_timer_fn fn;
+  void * arg;
+};
+
+struct sr_timer_wheel {
+  uint64_t clk;                  /* next tick to run */
+  struct sr_timer * root[1 << SR_TIMER_ROOT_BITS];
+  struct sr_timer * lvl[SR_TIMER_LEVELS][1 << SR_TIMER_LVL_BITS];
+};
+
+/* Starts the wheel at the current tick of the monotonic clock. */
+void sr_timer_wheel_init(struct sr_timer_wheel * wheel);
+
+/* Ticks of the monotonic clock, to pass to sr_timer_run. */
+uint64_t sr_timer_clock(void);
+
+void sr_timer_init(struct sr_timer * timer, sr_timer_fn fn, void * arg);
+
+/* Arms timer to fire ms from now, at the first tick run after that.
+   An armed timer is moved. */
+void sr_timer_add(struct sr_timer_wheel * wheel, struct sr_timer * timer,
+    unsigned long ms);
+
+/* Disarms timer, if armed. */
+void sr_timer_del(struct sr_timer * timer);
+
+#define sr_timer_pending(t) ((t)->pprev != 0)
+
+/* Runs every tick up to and including now, firing the timers due. */
+void sr_timer_run(struct sr_timer_wheel * wheel, uint64_t now);
+
+#endif /* -- SR_TIMER_H -- */
@@ -1,27 +1,97 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include "sr_adj.h"
+#include "sr_fib.h"
 #include "sr_protocol.h"
 #include "sr_utils.h"
 
 /* ==< longest prefix match >================================================ */
 
-static struct sr_rt *
-__sr_longest_prefix_match(struct sr_rt * route, struct sr_rt * ans, unsigned long lpm, unsigned long ip) 
+/* Route for ip (network byte order) in routing table vrf and, if iface is
+   not NULL, its egress interface, which for an equal cost group is that of
+   its first next hop. Answers from the result cache when it
+   can; the tables share it, which is safe because no two fibs ever have
+   the same generation. Call inside sr_rcu_read_lock; the route is only
+   good until the matching unlock. */
+struct sr_rt *
+sr_longest_prefix_match_ip(struct sr_instance * sr,unsigned int vrf,
+    uint32_t ip,struct sr_if ** iface)
 {
-  if(route == NULL) return ans;
-  if((route->gw.s_addr & route->mask.s_addr) == (ip & route->mask.s_addr)) {
-    if(lpm <= route->mask.s_addr) {
-      return __sr_longest_prefix_match(route->next,route,route->mask.s_addr,ip);
+  struct sr_fib * fib = sr_rcu_dereference(sr->vrf[vrf].fib);
+  struct sr_rt * route = NULL;
+  struct sr_if * egress = NULL;
+  struct sr_adj * adj;
+  uint32_t gen;
+
+  if(fib == NULL) return NULL;
+
+  /* read before the lookup, so a result computed from a fib that changes
+     under us is filed under the generation it belongs to */
+  gen = __atomic_load_n(&(fib->gen),__ATOMIC_ACQUIRE);
+
+  if(sr->rt_cache == NULL
+      || !sr_fib_cache_lookup(sr->rt_cache,gen,ip,&route,&egress)) {
+    route = sr_fib_lookup(fib,ip);
+    if(route) {
+      adj = sr_rcu_dereference(route->adj);
+      egress = adj ? adj->iface : sr_get_interface(sr,route->interface);
     }
+    if(sr->rt_cache)
+      sr_fib_cache_fill(sr->rt_cache,gen,ip,route,egress);
+  }
+
+  if(iface) *iface = egress;
+  return route;
+}
+
+struct sr_rt *
+sr_longest_prefix_match(struct sr_instance * sr,unsigned int vrf,
+    uint8_t * packet) 
+{
+  return sr_longest_prefix_match_ip(sr,vrf,sr_get_ip_dst(packet),NULL);
+}
+
+/* ==< equal cost multipath >=============================================== */
+
+/* Hash of the packet's 5-tuple, len bytes long. Fragments hash on
+   addresses and protocol only, so every fragment of a datagram takes the
+   same path, and so do datagrams too short to hold both ports. */
+uint32_t
+sr_flow_hash(uint8_t * packet,unsigned int len)
+{
+  uint8_t proto = sr_get_ip_p(packet);
+  uint32_t ports = 0;
+  uint32_t h;
+
+  if((ntohs(sr_get_ip_off(packet)) & (IP_MF | IP_OFFMASK)) == 0
+      && len >= ETH_HDR_LEN + IP_HDR_LEN + 4) {
+    if(proto == ip_protocol_tcp)
+      ports = (uint32_t)sr_get_tcp_src(packet) << 16 | sr_get_tcp_dst(packet);
+    else if(proto == ip_protocol_udp)
+      ports = (uint32_t)sr_get_udp_src(packet) << 16 | sr_get_udp_dst(packet);
   }
-  return __sr_longest_prefix_match(route->next,ans,lpm,ip);
+
+  h = sr_get_ip_src(packet) * 0x9e3779b1U;
+  h = (h ^ sr_get_ip_dst(packet)) * 0x85ebca6bU;
+  h = (h ^ ports ^ proto) * 0xc2b2ae35U;
+  return h ^ (h >> 16);
 }
 
+/* Next hop of route for packet, and counts the packet against it. Flows
+   stay on one member of an equal cost group for as long as the group is
+   unchanged. Call inside sr_rcu_read_lock, like the lookup. */
 struct sr_rt *
-sr_longest_prefix_match(struct sr_instance * sr,uint8_t * packet) 
+sr_ecmp_select(struct sr_rt * route,uint8_t * packet,unsigned int len)
 {
-  return __sr_longest_prefix_match(sr->routing_table,NULL,0,sr_get_ip_dst(packet));
+  struct sr_nhg * nhg = sr_rcu_dereference(route->nhg);
+
+  if(nhg)
+    route = nhg->nh[((uint64_t)sr_flow_hash(packet,len) * nhg->n) >> 32];
+
+  __atomic_add_fetch(&(route->packets),1,__ATOMIC_RELAXED);
+  __atomic_add_fetch(&(route->bytes),len,__ATOMIC_RELAXED);
+  return route;
 }
 
 uint16_t cksum (const void *_data, int len) {
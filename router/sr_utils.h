@@ -31,7 +31,13 @@
 #ifndef SR_UTILS_H
 #define SR_UTILS_H
 
-struct sr_rt * sr_longest_prefix_match(struct sr_instance * sr,uint8_t * packet);
+struct sr_rt * sr_longest_prefix_match(struct sr_instance * sr,unsigned int vrf,
+    uint8_t * packet);
+struct sr_rt * sr_longest_prefix_match_ip(struct sr_instance * sr,
+    unsigned int vrf,uint32_t ip,struct sr_if ** iface);
+struct sr_rt * sr_ecmp_select(struct sr_rt * route,uint8_t * packet,
+    unsigned int len);
+uint32_t sr_flow_hash(uint8_t * packet,unsigned int len);
 uint16_t cksum(const void *_data, int len);
 
 uint16_t ethertype(uint8_t *buf);
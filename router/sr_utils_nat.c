@@ -3,20 +3,27 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "sr_router.h"
 #include "sr_nat.h"
 #include "sr_protocol.h"
+#include "sr_utils_nat.h"
 
 void
 sr_print_conns(struct sr_nat_connection * conns_list)
 {
+  static const char * states[] = { "syn sent", "established", "fin wait",
+    "time wait" };
   if(conns_list == NULL) {
     fprintf(stderr, "\tConns list: NULL\n");
     return;
   }
   fprintf(stderr, "\tConns:\n");
   while(conns_list) {
+    fprintf(stderr,"\t\tPeer: %d:%d\n",conns_list->ip_peer,
+      ntohs(conns_list->aux_peer));
+    fprintf(stderr,"\t\tState: %s\n",states[conns_list->state]);
     fprintf(stderr,"\t\tPacket: %p\n",conns_list->packet);
     fprintf(stderr,"\t\tLen: %d\n",conns_list->len);
     fprintf(stderr,"\t\tInterface: %s\n",conns_list->interface);
@@ -30,36 +37,47 @@ void
 sr_print_natcache(struct sr_instance * sr)
 {
   struct sr_nat * nat = sr->nat;
-  struct sr_nat_mapping * mappings = nat->mappings;
-  if(mappings == NULL) {
-    fprintf(stderr, "\tFailed to print nat mappings. nat-> mappings is NULL\n");
-    return;
+  struct sr_nat_mapping * mappings;
+  static const char * types[] = { "icmp", "tcp", "udp" };
+  unsigned int held, held_syn;
+  unsigned long exhausted, refused_syn;
+  int t, i;
+  for(t = 0; t < nat_mapping_unknown; t++) {
+    held = held_syn = 0;
+    exhausted = refused_syn = 0;
+    for(i = 0; i < SR_NAT_SHARDS; i++) {
+      held += nat->shards[i].ports[t].held;
+      held_syn += nat->shards[i].ports[t].held_syn;
+      exhausted += nat->shards[i].ports[t].exhausted;
+      refused_syn += nat->shards[i].ports[t].refused_syn;
+    }
+    fprintf(stderr, "%s: %u ports held, %lu requests found none free\n",
+      types[t], held, exhausted);
+    if(t == nat_mapping_tcp)
+      fprintf(stderr, "%s: %u ports held for unsolicited SYNs, "
+        "%lu SYNs refused over the limit\n", types[t], held_syn, refused_syn);
   }
-  fprintf(stderr, "Head of mappings list:\n");
-  while(mappings) {
-    fprintf(stderr, "\tip_int: %d\n", mappings->ip_int);
-    fprintf(stderr, "\tip_ext: %d\n", mappings->ip_ext);
-    fprintf(stderr, "\taux_int: %d\n", mappings->aux_int);
-    fprintf(stderr, "\taux_ext: %d\n", mappings->ip_int);
-    fprintf(stderr, "\tlast update: %lld\n", (long long)mappings->last_updated);
-    sr_print_conns(mappings->conns);
-    fprintf(stderr, "\n");
-    mappings = mappings->next;
+  for(i = 0; i < SR_NAT_SHARDS; i++) {
+    mappings = nat->shards[i].mappings;
+    if(mappings == NULL) {
+      continue;
+    }
+    fprintf(stderr, "Head of shard %d mappings list:\n", i);
+    while(mappings) {
+      fprintf(stderr, "\tip_int: %d\n", mappings->ip_int);
+      fprintf(stderr, "\tip_ext: %d\n", mappings->ip_ext);
+      fprintf(stderr, "\taux_int: %d\n", mappings->aux_int);
+      fprintf(stderr, "\taux_ext: %d\n", mappings->ip_int);
+      fprintf(stderr, "\tlast update: %lld\n", (long long)mappings->last_updated);
+      sr_print_conns(mappings->conns);
+      fprintf(stderr, "\n");
+      mappings = mappings->next;
+    }
   }
   return;
 }
 
 /* ---< private routines >--------------------------------------------------- */
-/* --< allocators >---------------------------------------------------------- */
-/* -< external port >-------------------------------------------------------- */
-static uint16_t
-sr_nat_assign_ext_aux (void)
-{
-  static uint16_t next_ext_aux = 1023;
-  next_ext_aux++;
-  if(next_ext_aux == 0) next_ext_aux = 1024;
-  return next_ext_aux;
-}
 /* --< nap ip's>------------------------------------------------------------- */
 /* -< get nat internal ip >-------------------------------------------------- */
 uint32_t
@@ -108,6 +126,92 @@ sr_nat_allocate_nat_connection_external (
   return conn;
 }
 
+/* -< external ports >------------------------------------------------------- */
+void
+sr_nat_init_ports (struct sr_nat_ports * ports, unsigned int shard)
+{
+  uint64_t others = ~(uint64_t)0;
+  unsigned int w;
+
+  /* -- a word spans whole runs of SR_NAT_SHARDS ports, so every word
+        has the same ports of the shard, none of them held -- */
+  for(w = shard; w < 64; w += SR_NAT_SHARDS)
+    others &= ~((uint64_t)1 << w);
+
+  memset(ports,0,sizeof(*ports));
+  for(w = 0; w < SR_NAT_PORT_WORDS; w++)
+    ports->used[w] = others;
+  for(w = 0; w < SR_NAT_PORT_MIN / 64; w++) {
+    ports->used[w] = ~(uint64_t)0;
+    ports->full[w / 64] |= (uint64_t)1 << (w % 64);
+  }
+  ports->next = SR_NAT_PORT_MIN / 64;
+}
+
+static void
+sr_nat_hold_port (struct sr_nat_ports * ports, uint16_t port)
+{
+  unsigned int w = port / 64;
+
+  ports->used[w] |= (uint64_t)1 << (port % 64);
+  if(ports->used[w] == ~(uint64_t)0)
+    ports->full[w / 64] |= (uint64_t)1 << (w % 64);
+  ports->held++;
+}
+
+int
+sr_nat_alloc_port (struct sr_nat_ports * ports)
+{
+  unsigned int w = ports->next;
+  unsigned int s = 0, n;
+  uint64_t free_words = 0;
+
+  /* -- first word past the last one used with a free port, wrapping -- */
+  if(ports->used[w] == ~(uint64_t)0) {
+    for(n = 0; n <= SR_NAT_PORT_WORDS / 64; n++) {
+      s = (w / 64 + n) % (SR_NAT_PORT_WORDS / 64);
+      free_words = ~ports->full[s];
+      if(n == 0)
+        free_words &= ~(uint64_t)0 << (w % 64);
+      if(free_words)
+        break;
+    }
+    if(!free_words) {
+      ports->exhausted++;
+      return -1;
+    }
+    w = s * 64 + __builtin_ctzll(free_words);
+    ports->next = w;
+  }
+
+  n = w * 64 + __builtin_ctzll(~ports->used[w]);
+  sr_nat_hold_port(ports,(uint16_t)n);
+  return (int)n;
+}
+
+int
+sr_nat_take_port (struct sr_nat_ports * ports, uint16_t port)
+{
+  if(port < SR_NAT_PORT_MIN
+      || (ports->used[port / 64] & ((uint64_t)1 << (port % 64))))
+    return -1;
+  sr_nat_hold_port(ports,port);
+  return 0;
+}
+
+void
+sr_nat_release_port (struct sr_nat_ports * ports, uint16_t port)
+{
+  unsigned int w = port / 64;
+
+  if(port < SR_NAT_PORT_MIN
+      || !(ports->used[w] & ((uint64_t)1 << (port % 64))))
+    return;
+  ports->used[w] &= ~((uint64_t)1 << (port % 64));
+  ports->full[w / 64] &= ~((uint64_t)1 << (w % 64));
+  ports->held--;
+}
+
 /* --< constructors >-------------------------------------------------------- */
 /* --< struct sr_nat_mapping >----------------------------------------------- */
 void
@@ -124,10 +228,9 @@ sr_nat_construct_nat_mapping (
   mapping->ip_int = ip_int;
   mapping->ip_ext = sr_get_nat_ip_external(sr);
   mapping->aux_int = aux_int;
-  mapping->aux_ext = sr_nat_assign_ext_aux();
+  mapping->aux_ext = 0; /* assigned when inserted */
   mapping->last_updated = time(NULL);
   mapping->conns = NULL;
-  mapping->next = NULL;
 }
 
 void
@@ -145,7 +248,6 @@ sr_nat_construct_nat_mapping_external (
   mapping->aux_ext = aux_ext;
   mapping->last_updated = time(NULL);
   mapping->conns = NULL;
-  mapping->next = NULL;
   return;
 }
 
@@ -156,7 +258,17 @@ void sr_nat_construct_nat_connection(
   char * interface)
 {
   if (conn == NULL) return;
-  conn->packet = packet;
+  memset(conn,0,sizeof(*conn));
+  if (packet) {
+    /* -- the packet is lent, and must outlive its handling -- */
+    conn->packet = malloc(len);
+    if (conn->packet == NULL) {
+      fprintf(stderr,"[ERR] sr_nat_connection packet allocation failed : %s\n",
+        strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    memcpy(conn->packet,packet,len);
+  }
   conn->len = len;
   conn->interface = interface;
   conn->next = NULL;
@@ -168,70 +280,152 @@ struct sr_nat_connection * sr_nat_append_mapping_connection(
   struct sr_nat_connection * list,
   struct sr_nat_connection * tail)
 {
+  struct sr_nat_connection * it = list;
+
   if(list == NULL) return tail;
   if(tail == NULL) return list;
 
-  while(list->next) {list = list->next; }
+  while(it->next) { it = it->next; }
 
-  list->next = tail;
+  it->next = tail;
   return list;
 }
 /* --< mappings operations >------------------------------------------------- */
-/* -< append >--------------------------------------------------------------- */
-struct sr_nat_mapping *
-sr_nat_append_nat_mappings (
-  struct sr_nat_mapping * list,
-  struct sr_nat_mapping * tail )
+/* -< hashing >-------------------------------------------------------------- */
+/* Fibonacci hashing, as the arp cache does: the top bits of the product
+   depend on every bit of the key. Of the SR_NAT_HASH_BITS taken from the
+   internal key, the low ones pick the shard and the rest the bucket. */
+static unsigned int
+sr_nat_hash_int (uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type)
 {
-  if(list == NULL && tail == NULL) return NULL;
-  if(list == NULL) return tail;
-  if(tail == NULL) return list;
+  uint32_t h = ip_int * 2654435761u;
+  h ^= ((uint32_t)aux_int << 2) | type;
+  return (uint32_t)(h * 2654435761u) >> (32 - SR_NAT_HASH_BITS);
+}
+
+static unsigned int
+sr_nat_hash_ext (uint16_t aux_ext, sr_nat_mapping_type type)
+{
+  uint32_t key = ((uint32_t)aux_ext << 2) | type;
+  return (uint32_t)(key * 2654435761u)
+    >> (32 - SR_NAT_HASH_BITS + SR_NAT_SHARD_BITS);
+}
+/* -< shards >--------------------------------------------------------------- */
+struct sr_nat_shard *
+sr_nat_int_shard (
+  struct sr_nat * nat,
+  uint32_t ip_int,
+  uint16_t aux_int,
+  sr_nat_mapping_type type )
+{
+  return &(nat->shards[sr_nat_hash_int(ip_int,aux_int,type)
+      & (SR_NAT_SHARDS - 1)]);
+}
 
-  while(list->next) { list = list->next; }
+struct sr_nat_shard *
+sr_nat_ext_shard (struct sr_nat * nat, uint16_t aux_ext)
+{
+  return &(nat->shards[ntohs(aux_ext) & (SR_NAT_SHARDS - 1)]);
+}
+/* -< link >----------------------------------------------------------------- */
+void
+sr_nat_link_nat_mapping (
+  struct sr_nat_shard * shard,
+  struct sr_nat_mapping * mapping )
+{
+  struct sr_nat_mapping ** bucket;
 
-  list->next = tail;
-  return list;
+  mapping->prev = NULL;
+  mapping->next = shard->mappings;
+  if(mapping->next)
+    mapping->next->prev = mapping;
+  shard->mappings = mapping;
+
+  bucket = &(shard->ext_index[sr_nat_hash_ext(mapping->aux_ext,mapping->type)]);
+  mapping->ext_next = *bucket;
+  *bucket = mapping;
+
+  /* -- only mappings held for unsolicited SYNs have no internal side;
+        an aux_int of 0 is a valid port or echo id -- */
+  mapping->int_next = NULL;
+  if(mapping->ip_int) {
+    bucket = &(shard->int_index[sr_nat_hash_int(mapping->ip_int,
+          mapping->aux_int,mapping->type) >> SR_NAT_SHARD_BITS]);
+    mapping->int_next = *bucket;
+    *bucket = mapping;
+  }
+  shard->count++;
+}
+/* -< unlink >--------------------------------------------------------------- */
+void
+sr_nat_unlink_nat_mapping (
+  struct sr_nat_shard * shard,
+  struct sr_nat_mapping * mapping )
+{
+  struct sr_nat_mapping ** it;
+
+  if(mapping->prev)
+    mapping->prev->next = mapping->next;
+  else
+    shard->mappings = mapping->next;
+  if(mapping->next)
+    mapping->next->prev = mapping->prev;
+
+  it = &(shard->ext_index[sr_nat_hash_ext(mapping->aux_ext,mapping->type)]);
+  while(*it != mapping) { it = &((*it)->ext_next); }
+  *it = mapping->ext_next;
+
+  if(mapping->ip_int) {
+    it = &(shard->int_index[sr_nat_hash_int(mapping->ip_int,
+          mapping->aux_int,mapping->type) >> SR_NAT_SHARD_BITS]);
+    while(*it != mapping) { it = &((*it)->int_next); }
+    *it = mapping->int_next;
+  } else {
+    shard->ports[mapping->type].held_syn--;
+  }
+  sr_nat_release_port(&(shard->ports[mapping->type]),ntohs(mapping->aux_ext));
+  shard->count--;
 }
 /* -< internal lookup >------------------------------------------------------ */
 struct sr_nat_mapping *
 sr_nat_search_int_nat_mappings (
-  struct sr_nat_mapping * map_it,
+  struct sr_nat_shard * shard,
   uint32_t ip_int,
   uint16_t aux_int,
   sr_nat_mapping_type type )
-
 {
+  struct sr_nat_mapping * map_it;
+
+  map_it = shard->int_index[sr_nat_hash_int(ip_int,aux_int,type)
+    >> SR_NAT_SHARD_BITS];
   while(map_it) {
     if(   type    == map_it->type
-       && ip_int  == map_it->ip_ext
-       && aux_int == map_it->aux_ext)
+       && ip_int  == map_it->ip_int
+       && aux_int == map_it->aux_int)
     {
       break;
     }
-    map_it = map_it->next;
+    map_it = map_it->int_next;
   }
   return map_it;
 }
 /* -< external lookup >------------------------------------------------------ */
 struct sr_nat_mapping *
 sr_nat_search_ext_nat_mappings (
-  struct sr_nat_mapping * map_it,
-  uint32_t aux_ext,
+  struct sr_nat_shard * shard,
+  uint16_t aux_ext,
   sr_nat_mapping_type type )
 {
+  struct sr_nat_mapping * map_it;
+
+  map_it = shard->ext_index[sr_nat_hash_ext(aux_ext,type)];
   while(map_it) {
     if(   type    == map_it->type
-       && aux_ext == map_it->aux_int)
-    {
-      break;
-    }
-    if(   type    == map_it->type
-       && map_it->aux_int == 0
        && aux_ext == map_it->aux_ext)
     {
       break;
     }
-    map_it = map_it->next;
+    map_it = map_it->ext_next;
   }
   return map_it;
 }
@@ -9,9 +9,6 @@
 #define sr_nat_allocate_nat_connection() \
   sr_nat_allocate_nat_connection_external(__FILE__,__FUNCTION__,__LINE__)
 
-#define sr_nat_memcpy_nat_mapping(dst,src) \
-  memcpy(dst,src,sizeof(struct sr_nat_mapping))
-
 void
 sr_print_natcache(struct sr_instance * sr);
 
@@ -27,6 +24,22 @@ struct sr_nat_connection * sr_nat_allocate_nat_connection_external(
   const char * function,
   int line);
 
+/* -< external ports >------------------------------------------------------- */
+
+/* Marks the ports of shard from SR_NAT_PORT_MIN up free, and the others
+   held for good. */
+void sr_nat_init_ports(struct sr_nat_ports * ports, unsigned int shard);
+
+/* Holds and returns a free port, in host byte order, or counts the
+   request as exhausted and returns -1. */
+int sr_nat_alloc_port(struct sr_nat_ports * ports);
+
+/* Holds port, in host byte order, if it is free. Returns -1 if not. */
+int sr_nat_take_port(struct sr_nat_ports * ports, uint16_t port);
+
+/* Frees port, in host byte order, for reuse. */
+void sr_nat_release_port(struct sr_nat_ports * ports, uint16_t port);
+
 /* --< constructors >-------------------------------------------------------- */
 
 void sr_nat_construct_nat_mapping(
@@ -56,19 +69,36 @@ struct sr_nat_connection * sr_nat_append_mapping_connection(
 
 /* --< mappings operations >------------------------------------------------- */
 
-struct sr_nat_mapping * sr_nat_append_nat_mappings(
-  struct sr_nat_mapping * list,
-  struct sr_nat_mapping * tail);
+/* The shard a new mapping with this internal key goes to. */
+struct sr_nat_shard * sr_nat_int_shard(
+  struct sr_nat * nat,
+  uint32_t ip_int,
+  uint16_t aux_int,
+  sr_nat_mapping_type type);
+
+/* The shard holding any mapping on external port aux_ext. */
+struct sr_nat_shard * sr_nat_ext_shard(
+  struct sr_nat * nat,
+  uint16_t aux_ext);
+
+/* Adds mapping to the shard's list and indexes. Caller holds its lock. */
+void sr_nat_link_nat_mapping(
+  struct sr_nat_shard * shard,
+  struct sr_nat_mapping * mapping);
+
+/* Takes mapping off the shard's list and indexes. Caller holds its lock. */
+void sr_nat_unlink_nat_mapping(
+  struct sr_nat_shard * shard,
+  struct sr_nat_mapping * mapping);
 
 struct sr_nat_mapping * sr_nat_search_int_nat_mappings(
-  struct sr_nat_mapping * map_it,
+  struct sr_nat_shard * shard,
   uint32_t ip_int,
   uint16_t aux_int,
   sr_nat_mapping_type type);
 
 struct sr_nat_mapping * sr_nat_search_ext_nat_mappings(
-  struct sr_nat_mapping * map_it,
-  uint32_t aux_ext,
+  struct sr_nat_shard * shard,
+  uint16_t aux_ext,
   sr_nat_mapping_type type);
 #endif
-
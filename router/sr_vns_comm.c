@@ -41,6 +41,7 @@
 #include "sr_nat.h"
 #include "sr_protocol.h"
 #include "sr_router.h"
+#include "sr_rt.h"
 #include "sr_utils.h"
 
 #include "sha1.h"
@@ -450,11 +451,12 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */,
             /* -- pass to router, student's code should take over here -- */
 
             if(sr->nat) { 
-              sr_nat(sr,
+              if(sr_nat(sr,
                   (buf+sizeof(c_packet_header)),
                   len - sizeof(c_packet_ethernet_header) +
                   sizeof(struct sr_ethernet_hdr),
-                  (char*)(buf + sizeof(c_base)));
+                  (char*)(buf + sizeof(c_base))))
+              { break; }
             }
             sr_handlepacket(sr,
                     (buf+sizeof(c_packet_header)),
@@ -486,6 +488,14 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */,
 
         case VNSHWINFO:
             sr_handle_hwinfo(sr,(c_hwinfo*)buf);
+            sr_rt_bind(sr);
+            /* -- neighbors name interfaces, known only from here on -- */
+            if(sr->neighbors && sr_arpcache_load(sr, sr->neighbors) != 0)
+            {
+                fprintf(stderr,"Error loading neighbors from %s\n",
+                        sr->neighbors);
+                exit(1);
+            }
             if(sr_verify_routing_table(sr) != 0)
             {
                 fprintf(stderr,"Routing table not consistent with hardware\n");